@@ -1,14 +1,87 @@
+#define GL_GLEXT_PROTOTYPES            // Framebuffer objects, for the glyph atlas
 #include <GL/glut.h>  // might need GL/glut.h
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdarg.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <libgen.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#endif
 
-#define GRAVITY -0.005
-#define SPEED_FACTOR 0.1
-#define FRICTION_FACTOR 0.9
-#define GROUND_SIZE 15.0
-#define SPHERE_RADIUS 2.0
+#define MAX_SPHERES 16                  // Sphere colliders a scene may define
+#define MAX_EMITTERS 8                  // Emitters a scene may define
+#define MAX_FIELDS 8                    // Force fields a scene may define
+#define FIELD_BLOCK_SIZE 256            // Particles gathered per block of the force-field pass
+#define SDF_GROUND_THICKNESS 1.0        // Depth of the ground slab baked into a distance grid
+#define SDF_MARGIN 2.0                  // Padding of a distance grid around the colliders
+#define SDF_MAX_POINTS 4194304          // Largest distance grid a scene may bake, 64 MB
+#define MAX_MESHES 8                    // OBJ mesh colliders a scene may load
+#define MESH_CONTACT_OFFSET 0.05        // Distance a particle is moved off a mesh it hits
+#define BVH_BINS 12                     // Candidate splits per axis when building a mesh BVH
+#define BVH_MAX_DEPTH 48                // Deeper BVH nodes are made leaves, bounding the traversal stack
+#define SCENE_LINE_LENGTH 256
+#define SCENE_GRACE_FRAMES 2            // Frames drawn after a scene is replaced before it is freed
+#define GROUND_CONTACT_HEIGHT 0.1       // Height of a particle's centre resting on the ground
+#define DEPOSIT_RESOLUTION 64           // Heightfield vertices along each side of the ground
+#define DEPOSIT_SPEED 0.3               // Slower particles on the ground merge into the heightfield
+#define DEPOSIT_CONTACT_MARGIN 0.05     // Height above resting contact still counted as on the ground
+#define DEPOSIT_HEIGHT 0.01             // Height a deposited particle adds, spread over four vertices
+#define DEPOSIT_MAX_HEIGHT 0.5          // Highest the deposit builds up
+#define GROUND_MESH_LINES (DEPOSIT_RESOLUTION + 2)  // Heightfield grid lines and the hole's edges, along each side
+#define MAX_TRAIL_LENGTH 64             // Most points a particle trail keeps, one per published frame
+#define TRAIL_BATCH 1024                // Trails drawn per call, so their points fit 16-bit indices
+#define PARTICLE_OPACITY 96             // Alpha of particles in the translucent render mode
+#define RADIX_BUCKETS 256               // Radix sort digits of 8 bits, four passes for a 32-bit key
+#define SORT_WORKERS 4                  // Threads sharing a large depth sort, the render thread included
+#define PARALLEL_SORT_MIN 65536         // Fewer particles are depth sorted on the render thread alone
+#define MAX_COLLISION_ITERATIONS 4      // Bounces resolved per particle per update
+#define MAX_STEP_TICKS 4                // Coarsest simulation timestep, in timer ticks
+#define TICK_MS 16
+#define DEATH_HEIGHT -75.0
+#define EVENT_MIN_INTERVAL 0.01         // Smallest gap, in ticks, between two events of a particle
+#define MAX_LOD_TICKS 8                 // Longest update interval of a distant or off-screen particle
+#define LOD_COLLIDER_MARGIN 3.0         // Particles this close to a collider keep the full update rate
+#define LOD_OFFSCREEN_FACTOR 64.0       // Error budget multiplier for particles outside the view
+#define INITIAL_PARTICLE_CAPACITY 1024  // Slots in the particle ring, grown by doubling
+#define COMPACTION_MIN_TOMBSTONES 256   // Tombstones tolerated before the ring is compacted
+#define GOVERNOR_INTERVAL 30            // Frames averaged between two quality decisions
+#define GOVERNOR_HEADROOM 0.7           // Quality is raised again below this fraction of the budget
+#define TRIPLE_BUFFER_FRESH 4           // Set on a triple buffer's middle slot while it is unread
+#define MAX_RENDER_HZ 144               // Cap on the interpolated redraw rate
+#define SPAWN_QUEUE_SIZE 256            // Spawn commands that can wait for the next tick, a power of two
+#define SHARED_MEMORY_NAME "/particle_fountain"  // POSIX shared-memory object of the particle export
+#define SHARED_MAGIC 0x50465831         // "PFX1", first word of the export
+#define SHARED_MAX_PARTICLES 65536      // Particles the export has room for, the rest are left out
+#define METRICS_SOCKET_PATH "/tmp/particle_fountain.sock"  // Unix socket the metrics are served on
+#define METRICS_REQUEST_WAIT_MS 100     // Wait for an HTTP request before answering a bare connection
+#define STATUS_TEXT_SIZE 4096           // Room for the keyboard options text
+#define GLYPH_ATLAS_SIZE 256            // Width and height of the HUD glyph texture
+#define FIRST_GLYPH 32                  // Printable ASCII, space to tilde, goes in the atlas
+#define GLYPH_COUNT 95
+#define DIRECTION_SCALE 4000.0          // Fixed-point steps per unit of direction, keeping the default gravity exact
+#define FIELD_REMAINDER_STEPS 32        // Fractions of a direction step the force fields' leftover is kept in, 5 bits
+#define SPEED_SCALE 8192.0              // Fixed-point steps per unit of speed
+#define ANGLE_UNITS 65536.0             // Binary angle units per turn, so angles wrap for free
+#define SORT_CHUNK_SIZE 1024            // Ring slots re-sorted per step, divides INITIAL_PARTICLE_CAPACITY
+#define MORTON_EXTENT 64.0              // Half-width of the cube Morton codes are quantized over
+#define PHILOX_ROUNDS 10                // Rounds of the counter-based generator
+#define TRACE_INTERVAL 60               // Ticks between two samples of a golden trace
+#define TRACE_LINE_LENGTH 512
 #define X 0
 #define Y 1
 #define Z 2
@@ -20,39 +93,578 @@ struct glob {
 
 struct glob global = { {0.0,0.0,0.0},Y };
 
+// Packed particle, 32 bytes: the state the update and render passes touch.
+// Whether a slot holds a live particle is kept in the ring's tombstone bitmap.
 struct Particle {
     float px, py, pz;                   // Position
-    float dx, dy, dz;                   // Direction
-    float speed;                        // Speed
-    float angleX, angleY, angleZ;       // Rotation angles
-    float dAngleX, dAngleY, dAngleZ;    // Angle increments
-    float color[3];                     // RGB Color
-    bool active;                        // Active state
+    short dx, dy, dz;                   // Direction, in 1 / DIRECTION_SCALE
+    unsigned short speed;               // Speed, in 1 / SPEED_SCALE
+    unsigned short angle[3];            // Rotation angles, in binary angle units
+    unsigned char color[3];             // RGB Color
+    unsigned char eventType;            // Kind of the next scheduled event (event-driven mode)
+    unsigned short fieldRemainder;      // Force-field change short of a whole direction step, 5 bits per axis
 };
 
+// Timing of a particle, only touched by the event-driven and LOD schedulers
+// and by expiry. Times are kept relative to birth to stay precise as floats.
+struct ParticleSchedule {
+    unsigned int birthTick;             // Sim time the particle was emitted at
+    float launchAge;                    // Age the packed state is valid at
+    float eventAge;                     // Age of the next scheduled event or LOD update
+    unsigned int handle;                // Index of the particle's entry in the handle table
+};
+
+// Unpacked position and motion the collision and trajectory maths work on
+struct ParticleState {
+    float px, py, pz;
+    float dx, dy, dz;
+    float speed;
+};
+
+// Particle state as of the previously published render frame
+struct ParticleHistory {
+    float position[3];
+    unsigned short angle[3];
+};
+
+// Ring buffer of particles in emission order. Particles are addressed by a
+// sequence number that keeps counting up; seq lives in slot seq & (capacity - 1).
+// Out of order deaths leave a tombstone that is skipped until the tail passes
+// it or the ring is compacted.
 struct ParticleList {
-    struct ParticleNode* head;
-    struct ParticleNode* tail;
-    int size;
+    struct Particle* particles;
+    struct ParticleSchedule* schedules; // Per slot, alongside particles
+    struct ParticleHistory* history;    // Per slot, alongside particles
+    unsigned int* tombstones;   // Bitmap of retired slots
+    unsigned int capacity;      // Power of two
+    unsigned int head;          // Sequence number of the next particle to emit
+    unsigned int tail;          // Sequence number of the oldest slot in use
+    int size;                   // Live particles between tail and head
+};
+
+// Stable reference to a particle. Goes stale once the particle dies, even if
+// its entry in the handle table is reused.
+struct ParticleHandle {
+    unsigned int index;
+    unsigned int generation;
+};
+
+struct HandleEntry {
+    unsigned int seq;           // Where the particle currently lives in the ring
+    unsigned int generation;    // Bumped when the particle dies, 0 is never valid
+};
+
+// Handle table, updated wherever the ring moves particles
+struct HandleTable {
+    struct HandleEntry* entries;
+    unsigned int* freeList;     // Entries of dead particles, free for reuse
+    unsigned int count;
+    unsigned int capacity;
+    unsigned int freeCount;
+};
+
+struct Sphere {
+    float center[3];
+    float color[3];
+};
+
+// Spin of every particle in random spin mode, in binary angle units per tick
+// (2, 3 and 1.5 degrees)
+const unsigned short spinRates[3] = { 364, 546, 273 };
+
+// Source of the constant stream and of manually fired particles
+struct Emitter {
+    float position[3];
+    float spread;       // Largest horizontal launch direction, doubled in spray mode
+    float rate;         // Particles per tick at full quality
+};
+
+enum ForceFieldType {
+    FIELD_WIND,             // Uniform acceleration
+    FIELD_ATTRACTOR,        // Towards a point, or away from it with a negative strength
+    FIELD_VORTEX,           // Around an axis through a point
+    FIELD_TURBULENCE,       // Divergence-free sum of sines, drifting with time
+    FIELD_GRID,             // Baked vectors, interpolated trilinearly
+};
+
+// Force field acting on every particle. Accelerations are in the units of
+// gravity, direction units per tick.
+struct ForceField {
+    int type;
+    float position[3];      // Attractor or vortex centre, grid minimum corner
+    float vector[3];        // Wind acceleration, unit vortex axis, grid maximum corner
+    float strength;
+    float radius;           // Falloff of attractors and vortices, wavelength of turbulence
+    float drift;            // Turbulence phase speed, in wavelengths per tick
+    int size[3];            // Grid points along each axis
+    float* grid;            // Grid vectors, x varying fastest
+};
+
+// Colliders baked into a grid of signed distances to their surfaces, each
+// point storing the distance and the unit gradient
+struct DistanceGrid {
+    float origin[3];        // Position of the first point
+    float cellSize;
+    int size[3];            // Points along each axis
+    float* samples;         // Distance, gradient x, y, z per point, x varying fastest
+};
+
+// Mesh triangle prepared for segment tests: a corner, the two edges from it
+// and the unit face normal
+struct Triangle {
+    float v0[3];
+    float e1[3];
+    float e2[3];
+    float normal[3];
+};
+
+// Node of a bounding volume hierarchy. Leaves hold count triangles from
+// first; inner nodes have a count of 0 and their children at first and
+// first + 1.
+struct BvhNode {
+    float lo[3];
+    int first;
+    float hi[3];
+    int count;
+};
+
+// Triangles of every mesh of a scene: in load order as arrays to draw, and
+// reordered under a BVH built with the surface area heuristic to test
+// particle moves against
+struct MeshGeometry {
+    float* vertices;            // Three corners per triangle
+    float* normals;             // The face normal at each corner
+    int triangleCount;
+    int capacity;
+    struct Triangle* triangles;
+    struct BvhNode* nodes;
+    int nodeCount;
+};
+
+// OBJ file loaded as a static collider
+struct Mesh {
+    float color[3];
+    int first;                  // First triangle in the scene's mesh geometry
+    int count;
+    float lo[3];                // Bounds
+    float hi[3];
+};
+
+// Everything that defines a scene, loaded from a scene file or left at the
+// built-in defaults. Shared by the collision and render code.
+struct Scene {
+    float gravity;
+    float speedFactor;
+    float friction;
+    float groundSize;   // Half-width of the square ground
+    float hole[4];      // Min x, min z, max x, max z of the hole in the ground
+    float sphereRadius;
+    struct Sphere spheres[MAX_SPHERES];
+    int sphereCount;
+    struct Emitter emitters[MAX_EMITTERS];
+    int emitterCount;
+    struct ForceField fields[MAX_FIELDS];
+    int fieldCount;
+    struct DistanceGrid* sdf;   // Ground and spheres baked into a distance grid, or NULL to test them directly
+    struct Mesh meshes[MAX_MESHES];
+    int meshCount;
+    struct MeshGeometry* geometry;  // Triangles of the meshes, or NULL without any
+    float eye[3];       // Camera position
+    float target[3];    // Point the camera looks at
+    unsigned int seed;
+    int ticks;          // Length of a headless run
+    struct Scene* nextRetired;      // Next replaced scene waiting to be freed
+    unsigned int retiredAtFrame;    // framesDrawn when the scene was replaced
+};
+
+const struct Scene defaultScene = {
+    .gravity = -0.005,
+    .speedFactor = 0.1,
+    .friction = 0.9,
+    .groundSize = 15.0,
+    .hole = { 5.0, 5.0, 10.0, 10.0 },
+    .sphereRadius = 2.0,
+    .spheres = {
+        { {-10.0, 2.0, -10.0}, {0.0, 0.8, 0.0} },
+        { {5.0, 2.0, -5.0}, {0.8, 0.0, 0.0} },
+    },
+    .sphereCount = 2,
+    .emitters = { { {0.0, 0.5, 0.0}, 0.5, 1.0 } },
+    .emitterCount = 1,
+    .eye = { 0.0, 35.0, 25.0 },
+    .target = { 0.0, 0.0, 0.0 },
+    .seed = 1,
+    .ticks = 3600,
+};
+
+// Scene in use. The simulation thread swaps in a reloaded scene between
+// ticks; other threads take one snapshot of the pointer per use, so they
+// always see a whole scene.
+_Atomic(const struct Scene*) scene = &defaultScene;
+_Atomic(struct Scene*) pendingScene = NULL;    // Reloaded scene waiting for the next tick
+struct Scene* retiredScenes = NULL;             // Replaced scenes, newest first. Simulation thread only.
+atomic_uint framesDrawn = 0;                    // Frames the renderer has finished drawing
+
+enum ParticleEventType {
+    EVENT_GROUND,       // Lands on the ground
+    EVENT_DEATH,        // Falls below the death plane
+    EVENT_SPHERE,       // Enters the horizontal bounds of a sphere
+    EVENT_STEP,         // Inside a sphere's bounds, integrated tick by tick
 };
 
-struct ParticleNode {
-    struct ParticleNode* next;
-    struct ParticleNode* prev;
-    struct Particle particle;
+struct ParticleEvent {
+    double time;
+    struct ParticleHandle handle;
+};
+
+// Binary min-heap of pending particle events, one entry per particle.
+// Entries of particles that died early stay behind until they come due.
+struct EventQueue {
+    struct ParticleEvent* events;
+    int size;
+    int capacity;
 };
 
 struct ParticleList particleList;
-struct ParticleNode* selectedParticleNode = NULL;
+struct EventQueue eventQueue;
+struct HandleTable handleTable;
+struct ParticleHandle selectedParticle = { 0, 0 };  // Particle followed by the particle view
+
+// Incremental re-sort of the ring into Morton order, one aligned chunk of
+// sequence numbers per step. Chunks keep their place in emission order.
+struct ParticleSort {
+    unsigned int keys[2][SORT_CHUNK_SIZE];
+    unsigned short order[2][SORT_CHUNK_SIZE];   // Offsets into the chunk, sorted by key
+    struct Particle particles[SORT_CHUNK_SIZE];
+    struct ParticleSchedule schedules[SORT_CHUNK_SIZE];
+    struct ParticleHistory history[SORT_CHUNK_SIZE];
+    unsigned int cursor;                        // Sequence number the next chunk starts at
+    float ticks;                                // Ticks since the last step
+};
+
+struct ParticleSort particleSort;
+
+// Rungs the frame-time governor steps down to stay within its budget
+struct QualityLevel {
+    float emission;         // Fraction of the constant stream that is emitted
+    int sphereSlices;       // Tessellation of the spheres
+    bool pointParticles;    // Draw particles as points whatever the render mode
+};
+
+const struct QualityLevel qualityLevels[] = {
+    { 1.0, 20, false },
+    { 1.0, 12, false },
+    { 0.75, 12, false },
+    { 0.75, 12, true },
+    { 0.5, 8, true },
+    { 0.25, 6, true },
+    { 0.1, 6, true },
+};
+
+#define QUALITY_LEVEL_COUNT ((int)(sizeof(qualityLevels) / sizeof(qualityLevels[0])))
+
+struct Governor {
+    bool enabled;
+    float budgetMs;         // Target cost of a frame, the slower of simulation and rendering
+    atomic_int level;       // Index into qualityLevels
+    double totalMs;         // Frame cost summed over the current interval
+    int frames;
+    float averageMs;        // Average frame cost of the last interval
+    float emissionCredit[MAX_EMITTERS];   // Fractional particles owed to the constant stream
+};
+
+struct Governor governor = { true, 16.6, 0, 0.0, 0, 0.0, { 0.0 } };
+
+enum Metric {
+    METRIC_SPAWNS,
+    METRIC_DEATHS_STOPPED,      // Slowed below the minimum speed
+    METRIC_DEATHS_FELL,         // Fell below DEATH_HEIGHT
+    METRIC_DEATHS_EXPIRED,      // Outlived maxLifetime
+    METRIC_DEATHS_DEPOSITED,    // Merged into the ground deposit
+    METRIC_GROUND_COLLISIONS,
+    METRIC_SPHERE_COLLISIONS,
+    METRIC_SDF_COLLISIONS,
+    METRIC_MESH_COLLISIONS,
+    METRIC_TICKS,
+    METRIC_COMMANDS_NS,         // Stage timings of the simulation tick
+    METRIC_UPDATE_NS,
+    METRIC_EMIT_NS,
+    METRIC_PUBLISH_NS,
+    METRIC_FRAMES,
+    METRIC_RENDER_NS,
+    METRIC_COUNT,
+};
+
+enum MetricThread {
+    METRIC_THREAD_SIMULATION,
+    METRIC_THREAD_RENDER,
+    METRIC_THREAD_COUNT,
+};
+
+// Counters of one thread. Only the owning thread writes them, so adding is
+// a plain load and store; the metrics server sums the threads when scraped.
+struct ThreadMetrics {
+    _Alignas(64) atomic_ullong counters[METRIC_COUNT];
+};
+
+struct ThreadMetrics threadMetrics[METRIC_THREAD_COUNT];
+unsigned long long tickMetrics[METRIC_COUNT];   // Simulation thread's counts, flushed once per tick
+atomic_int particleGauge = 0;                   // particleList.size as of the last tick
+
+// Recent positions of each particle, as one ring of trailLength points per
+// handle table entry in a single slab. Handles keep their entry while the
+// particle is re-sorted or compacted, so trails never move, and a ring is
+// emptied when its particle retires, ready for the next particle given the
+// handle. Owned by the simulation thread.
+struct TrailPool {
+    float (*points)[3];         // trailLength points per handle entry
+    unsigned char* count;       // Points in each ring
+    unsigned char* next;        // Where each ring's next point goes
+    unsigned int capacity;      // Handle entries the slab has room for
+};
+
+// Line segments of a batch of trails, as indices into their points
+struct TrailPattern {
+    GLushort* indices;
+    int stride;                 // Points per trail the pattern was laid out for
+};
+
+// LSD radix sort of particle indices by 32-bit key, a byte per pass. Large
+// sorts are split between the render thread and SORT_WORKERS - 1 helper
+// threads, each taking an equal share of the array in every pass.
+struct RadixSort {
+    unsigned int* keys[2];
+    unsigned int* values[2];    // Indices into the frame's particles, moved with their keys
+    int capacity;
+    int count;
+    int workers;                // Threads taking part in the current sort
+    int result;                 // Buffer holding the sorted keys and values
+    unsigned int digits[SORT_WORKERS][4][RADIX_BUCKETS];   // Digit counts of each share, for every pass, before sorting
+    unsigned int shares[SORT_WORKERS][RADIX_BUCKETS];      // Digit counts of each share in the current pass
+    pthread_barrier_t barrier;
+    int threads;                // Workers a large sort is split between, 0 until the helpers are started
+};
+
+// Back to front order of the particles of the frame last drawn translucent
+struct DepthOrder {
+    double publishMs;           // Frame the order was sorted for
+    GLfloat matrix[16];         // View it was sorted for
+    int count;
+};
+
+// Particle state handed from the simulation thread to the renderer
+struct RenderParticle {
+    float position[3];
+    float prevPosition[3];  // State in the frame before, to interpolate from
+    unsigned short angle[3];
+    unsigned short prevAngle[3];
+    unsigned char color[3];
+};
+
+// Particles merged into the ground, as a heightfield over a grid of
+// DEPOSIT_RESOLUTION by DEPOSIT_RESOLUTION vertices spanning the ground.
+// Owned by the simulation thread.
+struct Deposit {
+    float height[DEPOSIT_RESOLUTION * DEPOSIT_RESOLUTION];
+    float color[DEPOSIT_RESOLUTION * DEPOSIT_RESOLUTION][3];   // Sum of colours weighted by the height they added
+    unsigned int version;       // Counts changes, so frames copy the heights only when behind
+};
+
+// Ground as drawn: one mesh displaced by the deposit, over the heightfield's
+// grid with lines added along the hole's edges, so each cell is either wholly
+// in the hole, and left out, or wholly on the ground. Rebuilt by the render
+// thread when a frame brings a new deposit version or the ground changes.
+struct GroundMesh {
+    GLfloat vertices[GROUND_MESH_LINES * GROUND_MESH_LINES][3];
+    GLfloat normals[GROUND_MESH_LINES * GROUND_MESH_LINES][3];
+    GLubyte colors[GROUND_MESH_LINES * GROUND_MESH_LINES][3];
+    GLuint indices[(GROUND_MESH_LINES - 1) * (GROUND_MESH_LINES - 1) * 6];
+    int indexCount;
+    unsigned int version;
+    float groundSize;           // Ground the mesh was laid out for
+    float hole[4];
+};
+
+struct RenderFrame {
+    struct RenderParticle* particles;
+    int count;
+    int capacity;
+    float (*trailPoints)[3];            // trailStride points per particle, oldest first
+    unsigned char (*trailColors)[4];    // Colour and fade of each point
+    int trailStride;                    // Points per trail, 0 without trails
+    int trailCapacity;                  // Trails the arrays have room for
+    unsigned int depositVersion;
+    float depositHeight[DEPOSIT_RESOLUTION * DEPOSIT_RESOLUTION];
+    unsigned char depositColor[DEPOSIT_RESOLUTION * DEPOSIT_RESOLUTION][3];
+    bool hasSelected;       // Whether the particle view's particle is alive
+    float selected[3];      // Position of the particle view's particle
+    float prevSelected[3];
+    float simMs;            // Cost of the tick that produced the frame
+    double publishMs;       // When the frame was published
+    float stepMs;           // Simulated time between the previous frame and this one
+};
+
+// Lock-free single producer, single consumer triple buffer of slot indices.
+// The producer fills its back slot and swaps it into the middle; the consumer
+// swaps the middle for its front slot whenever the middle holds a fresh one.
+struct TripleBuffer {
+    atomic_int middle;
+    int back;
+    int front;
+};
+
+// View the LOD scheduler works against, captured when the scene is drawn
+struct ViewState {
+    GLfloat matrix[16];
+    float pixelsPerUnit;    // Screen pixels per world unit at distance 1
+};
+
+// Glyph's cell in the atlas, in pixels. Cells are as tall as their font's
+// lines and include a pixel of padding either side.
+struct Glyph {
+    short x;
+    short y;
+    short width;
+};
+
+struct AtlasFont {
+    void* font;
+    int lineHeight;
+    int descent;        // Pixels from the bottom of a line to its baseline
+    struct Glyph glyphs[GLYPH_COUNT];
+};
+
+enum HudFont {
+    HUD_FONT_LARGE,
+    HUD_FONT_SMALL,
+    HUD_FONT_COUNT,
+};
+
+// HUD fonts rasterized once into one alpha texture
+struct GlyphAtlas {
+    GLuint texture;             // 0 if the atlas could not be built
+    bool built;                 // Whether building it has been tried
+    struct AtlasFont fonts[HUD_FONT_COUNT];
+};
+
+struct TextVertex {
+    GLfloat u, v;
+    GLfloat x, y;
+};
+
+// Quads of all HUD text drawn in a frame, the status panel's first
+struct TextBatch {
+    struct TextVertex* vertices;
+    int count;
+    int capacity;
+    int panelCount;     // Vertices of the status panel, kept between frames
+};
+
+// Changes requested by the input handlers, applied by the simulation thread
+enum SimCommand {
+    COMMAND_RESET = 1,
+    COMMAND_TOGGLE_EVENTS = 2,
+    COMMAND_TOGGLE_LOD = 4,
+    COMMAND_SELECT_PARTICLE = 8,
+    COMMAND_TOGGLE_EXPORT = 16,
+    COMMAND_CYCLE_TRAILS = 32,
+};
+
+// Header of the shared-memory export, followed by one array per field with
+// an entry per particle, at the given byte offsets from the header. The
+// writer makes sequence odd while it updates the frame and even once done;
+// readers retry if it was odd or has changed by the time they are finished.
+// README.md describes the layout and read protocol for consumers.
+struct SharedFrameHeader {
+    unsigned int magic;
+    unsigned int capacity;      // Entries per array
+    atomic_uint sequence;
+    unsigned int count;         // Particles in the frame
+    double simTime;             // In timer ticks
+    unsigned int xOffset;       // float x[capacity], and likewise y and z
+    unsigned int yOffset;
+    unsigned int zOffset;
+    unsigned int colorOffset;   // RGBA8, red in the low byte
+};
+
+struct SharedExport {
+    struct SharedFrameHeader* header;
+    size_t size;
+    int fd;                     // Holds a lock on the object while this process owns it, else -1
+};
+
+// Request to emit count particles from an emitter that have already been
+// flying for age ticks
+struct SpawnCommand {
+    int emitter;        // Index into the scene's emitters
+    int count;
+    int age;
+};
+
+struct SpawnCell {
+    atomic_uint turn;       // Position the cell waits for next, less the cell's index
+    struct SpawnCommand command;
+};
+
+// Bounded lock-free multi-producer, single consumer queue of spawn commands.
+// Any thread may push; only the simulation thread pops. A cell's turn says
+// whether it waits for the producer or the consumer at a given position, so
+// producers claim cells with one compare-and-swap and a zeroed queue is empty.
+struct SpawnQueue {
+    struct SpawnCell cells[SPAWN_QUEUE_SIZE];
+    atomic_uint enqueuePos;
+    unsigned int dequeuePos;
+};
+
+struct RenderFrame renderFrames[3];
+struct Deposit deposit = { .version = 1 };  // Ahead of the frames, so the first one copies it
+struct GroundMesh groundMesh;       // Render thread only
+struct TrailPattern trailPattern;   // Render thread only
+struct TrailPool trailPool;
+struct RadixSort radixSort;         // Render thread and its sort helpers
+struct DepthOrder depthOrder = { .publishMs = -1.0 };
+atomic_int trailLength = 0;         // Points kept per trail, 0 for no trails. Set by the simulation thread.
+struct TripleBuffer renderBuffer = { 1, 0, 2 };
+struct ViewState viewStates[3];
+struct TripleBuffer viewBuffer = { 1, 0, 2 };
+atomic_int pendingCommands = 0;
+struct SpawnQueue spawnQueue;
+struct SharedExport sharedExport = { NULL, 0, -1 };   // Simulation thread only
+struct GlyphAtlas glyphAtlas = {
+    .fonts = {
+        { .font = GLUT_BITMAP_TIMES_ROMAN_24, .lineHeight = 29, .descent = 7 },
+        { .font = GLUT_BITMAP_HELVETICA_12, .lineHeight = 16, .descent = 4 },
+    },
+};
+struct TextBatch textBatch;
+atomic_bool exportMode = false;
+atomic_bool optionsChanged = false;  // Set once the simulation thread has applied a command
 
-bool constantStream = true;
-bool manualFiring = false;
-bool randomSpeedMode = false;
-bool randomSpinMode = true;
-bool frictionMode = true;
+atomic_bool constantStream = true;
+atomic_bool manualFiring = false;
+atomic_bool randomSpeedMode = false;
+atomic_bool randomSpinMode = true;
+atomic_bool frictionMode = true;
+atomic_bool depositionMode = false;
 bool backfaceCulling = false;
 bool particleView = false;
-bool sprayMode = false;
+atomic_bool sprayMode = false;
+atomic_int simStepTicks = 1;    // Timer ticks advanced per simulation update
+atomic_bool eventDrivenMode = false;
+atomic_bool lodMode = false;
+bool interpolationMode = true;
+bool statusPanel = true;
+bool statusPanelDirty = true;   // Mode state or window size has changed since the panel was laid out
+int windowWidth = 800;          // Cached by the reshape callback
+int windowHeight = 600;
+_Atomic float maxLifetime = 0.0;        // Ticks a particle may live, 0 for no limit
+_Atomic float lodErrorBudget = 0.5;     // Largest on-screen position error from coarse LOD updates, in pixels
+atomic_int sortInterval = 60;           // Ticks between two chunks of the Morton re-sort, 0 to disable
+double simTime = 0.0;   // Simulation time, in timer ticks
+unsigned int emitterSerials[MAX_EMITTERS];    // Particles each emitter has created, the RNG counter
+
+// Simulation thread's copy of the view used by the LOD scheduler
+struct ViewState lodView = { { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 }, 724.0 };
 
 GLfloat savedModelviewMatrix[16];
 int currentRenderMode = 3;
@@ -82,17 +694,32 @@ void toggleBackfaceCulling() {
     }
 }
 
+// Empty the ground deposit
+void clearDeposit() {
+    memset(deposit.height, 0, sizeof(deposit.height));
+    memset(deposit.color, 0, sizeof(deposit.color));
+    deposit.version++;
+}
+
 // Reset particle list and modes
 void resetSimulation() {
-    struct ParticleNode* currentNode = particleList.head;
-    while (currentNode != NULL) {
-        struct ParticleNode* nextNode = currentNode->next;
-        free(currentNode);
-        currentNode = nextNode;
+    memset(emitterSerials, 0, sizeof(emitterSerials));
+
+    // Every particle dies, so every handle goes stale
+    for (unsigned int index = 0; index < handleTable.count; index++) {
+        handleTable.entries[index].generation++;
+        handleTable.freeList[index] = index;
+    }
+    handleTable.freeCount = handleTable.count;
+    if (trailPool.capacity > 0) {
+        memset(trailPool.count, 0, trailPool.capacity);
     }
 
-    particleList.head = particleList.tail = NULL;
+    memset(particleList.tombstones, 0, particleList.capacity / 32 * sizeof(unsigned int));
+    particleList.head = particleList.tail = 0;
     particleList.size = 0;
+    eventQueue.size = 0;
+    clearDeposit();
 
     constantStream = true;
     manualFiring = false;
@@ -101,742 +728,4590 @@ void resetSimulation() {
     sprayMode = false;
 }
 
-// Create a new particle and add it to the list
-void createParticle() {
-    struct ParticleNode* newNode = (struct ParticleNode*)malloc(sizeof(struct ParticleNode));
-    if (newNode == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed for a new particle node.\n");
+struct Particle* particleAt(unsigned int seq) {
+    return &particleList.particles[seq & (particleList.capacity - 1)];
+}
+
+struct ParticleSchedule* scheduleAt(unsigned int seq) {
+    return &particleList.schedules[seq & (particleList.capacity - 1)];
+}
+
+// Sim time the particle's packed state is valid at
+double particleLaunchTime(unsigned int seq) {
+    return scheduleAt(seq)->birthTick + (double)scheduleAt(seq)->launchAge;
+}
+
+double particleEventTime(unsigned int seq) {
+    return scheduleAt(seq)->birthTick + (double)scheduleAt(seq)->eventAge;
+}
+
+short packDirection(float direction) {
+    return (short)fmaxf(fminf(lrintf(direction * DIRECTION_SCALE), 32767.0), -32767.0);
+}
+
+void unpackParticle(const struct Particle* particle, struct ParticleState* state) {
+    state->px = particle->px;
+    state->py = particle->py;
+    state->pz = particle->pz;
+    state->dx = particle->dx / DIRECTION_SCALE;
+    state->dy = particle->dy / DIRECTION_SCALE;
+    state->dz = particle->dz / DIRECTION_SCALE;
+    state->speed = particle->speed / SPEED_SCALE;
+}
+
+void packParticle(struct Particle* particle, const struct ParticleState* state) {
+    particle->px = state->px;
+    particle->py = state->py;
+    particle->pz = state->pz;
+    particle->dx = packDirection(state->dx);
+    particle->dy = packDirection(state->dy);
+    particle->dz = packDirection(state->dz);
+    particle->speed = (unsigned short)fminf(lrintf(state->speed * SPEED_SCALE), 65535.0);
+}
+
+// Advance the particle's angles by dt ticks of spin, wrapping as they overflow
+void spinParticle(struct Particle* particle, float dt) {
+    for (int i = 0; i < 3; i++) {
+        particle->angle[i] += (unsigned short)(lrintf(spinRates[i] * dt) & 0xFFFF);
+    }
+}
+
+bool isParticleRetired(unsigned int seq) {
+    unsigned int slot = seq & (particleList.capacity - 1);
+    return (particleList.tombstones[slot / 32] >> (slot % 32)) & 1;
+}
+
+// Take a handle table entry for a particle born at seq
+unsigned int acquireHandle(unsigned int seq) {
+    unsigned int index;
+
+    if (handleTable.freeCount > 0) {
+        index = handleTable.freeList[--handleTable.freeCount];
+    }
+    else {
+        if (handleTable.count == handleTable.capacity) {
+            unsigned int capacity = handleTable.capacity == 0 ? INITIAL_PARTICLE_CAPACITY : handleTable.capacity * 2;
+            struct HandleEntry* entries = (struct HandleEntry*)realloc(handleTable.entries,
+                capacity * sizeof(struct HandleEntry));
+            unsigned int* freeList = (unsigned int*)realloc(handleTable.freeList, capacity * sizeof(unsigned int));
+            if (entries == NULL || freeList == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed for the handle table.\n");
+                exit(EXIT_FAILURE);
+            }
+            handleTable.entries = entries;
+            handleTable.freeList = freeList;
+            handleTable.capacity = capacity;
+        }
+        index = handleTable.count++;
+        handleTable.entries[index].generation = 1;
+    }
+
+    handleTable.entries[index].seq = seq;
+    return index;
+}
+
+struct ParticleHandle particleHandle(unsigned int seq) {
+    unsigned int index = scheduleAt(seq)->handle;
+    return (struct ParticleHandle){ index, handleTable.entries[index].generation };
+}
+
+// Look up the particle a handle refers to. Returns false if it has died.
+bool resolveHandle(struct ParticleHandle handle, unsigned int* seq) {
+    if (handle.index >= handleTable.count || handleTable.entries[handle.index].generation != handle.generation) {
+        return false;
+    }
+    *seq = handleTable.entries[handle.index].seq;
+    return true;
+}
+
+// Record that the particle at seq now lives at newSeq
+void moveHandle(unsigned int seq, unsigned int newSeq) {
+    handleTable.entries[scheduleAt(seq)->handle].seq = newSeq;
+}
+
+void retireParticle(unsigned int seq) {
+    unsigned int slot = seq & (particleList.capacity - 1);
+    particleList.tombstones[slot / 32] |= 1u << (slot % 32);
+    particleList.size--;
+
+    unsigned int index = scheduleAt(seq)->handle;
+    handleTable.entries[index].generation++;
+    handleTable.freeList[handleTable.freeCount++] = index;
+    if (index < trailPool.capacity) {
+        trailPool.count[index] = 0;
+    }
+}
+
+// Allocate the ring with the given capacity, moving any particles over
+void resizeParticleList(unsigned int capacity) {
+    struct Particle* particles = (struct Particle*)malloc(capacity * sizeof(struct Particle));
+    struct ParticleSchedule* schedules = (struct ParticleSchedule*)malloc(capacity * sizeof(struct ParticleSchedule));
+    struct ParticleHistory* history = (struct ParticleHistory*)malloc(capacity * sizeof(struct ParticleHistory));
+    unsigned int* tombstones = (unsigned int*)calloc(capacity / 32, sizeof(unsigned int));
+    if (particles == NULL || schedules == NULL || history == NULL || tombstones == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for the particle ring.\n");
         exit(EXIT_FAILURE);
     }
 
+    // Sequence numbers are kept, so references to particles stay valid
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        unsigned int slot = seq & (capacity - 1);
+        particles[slot] = *particleAt(seq);
+        schedules[slot] = *scheduleAt(seq);
+        history[slot] = particleList.history[seq & (particleList.capacity - 1)];
+        if (isParticleRetired(seq)) {
+            tombstones[slot / 32] |= 1u << (slot % 32);
+        }
+    }
+
+    free(particleList.particles);
+    free(particleList.schedules);
+    free(particleList.history);
+    free(particleList.tombstones);
+    particleList.particles = particles;
+    particleList.schedules = schedules;
+    particleList.history = history;
+    particleList.tombstones = tombstones;
+    particleList.capacity = capacity;
+}
+
+// Philox4x32 counter-based generator (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3"). Its output is a pure function of the key
+// and the counter, so there is no shared state: a particle's numbers are
+// drawn from the key (seed, emitter) and the counter (particle index), and
+// come out the same whichever thread creates it and in whatever order.
+void philox4x32(const unsigned int counter[4], unsigned int seed, unsigned int stream, unsigned int out[4]) {
+    unsigned int c[4] = { counter[0], counter[1], counter[2], counter[3] };
+    unsigned int k[2] = { seed, stream };
+
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        unsigned long long p0 = 0xD2511F53ULL * c[0];
+        unsigned long long p1 = 0xCD9E8D57ULL * c[2];
+        unsigned int next[4] = {
+            (unsigned int)(p1 >> 32) ^ c[1] ^ k[0],
+            (unsigned int)p1,
+            (unsigned int)(p0 >> 32) ^ c[3] ^ k[1],
+            (unsigned int)p0,
+        };
+        memcpy(c, next, sizeof(c));
+        k[0] += 0x9E3779B9;
+        k[1] += 0xBB67AE85;
+    }
+    memcpy(out, c, sizeof(c));
+}
+
+// Map a 32-bit random word to an integer in [0, n)
+int randomBelow(unsigned int word, int n) {
+    return (int)(((unsigned long long)word * n) >> 32);
+}
+
+// Create a new particle from the emitter and add it to the head of the ring
+void createParticle(int emitterIndex) {
+    if (particleList.head - particleList.tail == particleList.capacity) {
+        resizeParticleList(particleList.capacity * 2);
+    }
+
+    const struct Emitter* emitter = &scene->emitters[emitterIndex];
+    // Two blocks give the six numbers a particle needs
+    unsigned int random[8];
+    for (unsigned int block = 0; block < 2; block++) {
+        unsigned int counter[4] = { emitterSerials[emitterIndex], block, 0, 0 };
+        philox4x32(counter, scene->seed, (unsigned int)emitterIndex, &random[block * 4]);
+    }
+    emitterSerials[emitterIndex]++;
+
     float speed;
     float dx;
     float dz;
 
-    if (!sprayMode) {
-        dx = ((rand() % 100) / 100.0) - 0.5;
-        dz = ((rand() % 100) / 100.0) - 0.5;
-    }
-    else {
-        dx = ((rand() % 200) / 100.0) - 1.0;
-        dz = ((rand() % 200) / 100.0) - 1.0;
-    }
+    float spread = sprayMode ? emitter->spread * 2.0 : emitter->spread;
+    dx = (randomBelow(random[0], 100) / 100.0 - 0.5) * 2.0 * spread;
+    dz = (randomBelow(random[1], 100) / 100.0 - 0.5) * 2.0 * spread;
 
     if (randomSpeedMode) {
-        speed = 1.0 + ((rand() % 10) / 10.0);
+        speed = 1.0 + (randomBelow(random[2], 10) / 10.0);
     }
     else {
         speed = 1.0;
     }
 
-    newNode->particle = (struct Particle){
-        .px = 0.0,
-        .py = 0.5,
-        .pz = 0.0,
+    struct ParticleState state = {
+        .px = emitter->position[X],
+        .py = emitter->position[Y],
+        .pz = emitter->position[Z],
         .dx = dx,
         .dy = 1.0,
         .dz = dz,
         .speed = speed,
-        .angleX = 0.0,
-        .angleY = 0.0,
-        .angleZ = 0.0,
-        .dAngleX = 2.0,
-        .dAngleY = 3.0,
-        .dAngleZ = 1.5,
-        .color = {((rand() % 100) / 100.0), ((rand() % 100) / 100.0), ((rand() % 100) / 100.0)},
-        .active = true,
     };
 
-    newNode->next = NULL;
-    newNode->prev = particleList.tail;
-
-    if (particleList.size == 0) {
-        particleList.head = newNode;
-    }
-    else {
-        particleList.tail->next = newNode;
-    }
+    struct Particle* particle = particleAt(particleList.head);
+    *particle = (struct Particle){
+        .color = {
+            randomBelow(random[3], 100) * 255 / 100,
+            randomBelow(random[4], 100) * 255 / 100,
+            randomBelow(random[5], 100) * 255 / 100,
+        },
+    };
+    packParticle(particle, &state);
+    *scheduleAt(particleList.head) = (struct ParticleSchedule){
+        .birthTick = (unsigned int)simTime,
+        .handle = acquireHandle(particleList.head),
+    };
+    particleList.history[particleList.head & (particleList.capacity - 1)] = (struct ParticleHistory){
+        .position = { state.px, state.py, state.pz },
+    };
 
-    particleList.tail = newNode;
+    particleList.head++;
     particleList.size++;
+    tickMetrics[METRIC_SPAWNS]++;
 }
 
 // Check if particle is within hole extents
-bool isParticleWithinHoleExtents(const struct Particle* particle) {
-    return (particle->px >= 5.0 && particle->px <= 10 &&
-        particle->pz >= 5.0 && particle->pz <= 10);
+bool isParticleWithinHoleExtents(const struct ParticleState* particle) {
+    return (particle->px >= scene->hole[0] && particle->px <= scene->hole[2] &&
+        particle->pz >= scene->hole[1] && particle->pz <= scene->hole[3]);
 }
 
 // Check if particle is within ground extents
-bool isParticleWithinGroundExtents(const struct Particle* particle) {
-    return (particle->px >= -GROUND_SIZE && particle->px <= GROUND_SIZE &&
-        particle->pz >= -GROUND_SIZE && particle->pz <= GROUND_SIZE);
+bool isParticleWithinGroundExtents(const struct ParticleState* particle) {
+    return (particle->px >= -scene->groundSize && particle->px <= scene->groundSize &&
+        particle->pz >= -scene->groundSize && particle->pz <= scene->groundSize);
 }
 
-// Remove inactive particles from the linked list
-void removeInactiveParticles() {
-    struct ParticleNode* currentNode = particleList.head;
-    struct ParticleNode* nextNode;
+float squaredDistance(float x1, float y1, float z1, float x2, float y2, float z2) {
+    float dx = x1 - x2;
+    float dy = y1 - y2;
+    float dz = z1 - z2;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+float lerp(float from, float to, float alpha) {
+    return from + (to - from) * alpha;
+}
 
-    while (currentNode != NULL) {
-        nextNode = currentNode->next;
+void applyFriction(struct ParticleState* particle) {
+    particle->speed *= scene->friction;
+    particle->dx *= scene->friction;
+    particle->dy *= scene->friction;
+    particle->dz *= scene->friction;
+}
 
-        if (!currentNode->particle.active) {
-            // Node is inactive, remove it from the linked list
-            if (currentNode->prev != NULL) {
-                currentNode->prev->next = currentNode->next;
-            }
-            else {
-                // The node is the head of the list
-                particleList.head = currentNode->next;
-            }
+// Time of impact, as a fraction of the move, with the top of the ground.
+// Returns a value outside [0, 1] if the move does not land on the ground.
+float groundTimeOfImpact(const struct ParticleState* particle, const float move[3]) {
+    float endY = particle->py + move[Y];
+    if (move[Y] >= 0.0 || particle->py < GROUND_CONTACT_HEIGHT || endY >= GROUND_CONTACT_HEIGHT) {
+        return -1.0;
+    }
+
+    float t = (particle->py - GROUND_CONTACT_HEIGHT) / (particle->py - endY);
+
+    // Only count the hit if the impact point is on solid ground
+    struct ParticleState impact = *particle;
+    impact.px += move[X] * t;
+    impact.pz += move[Z] * t;
+    if (!isParticleWithinGroundExtents(&impact) || isParticleWithinHoleExtents(&impact)) {
+        return -1.0;
+    }
+    return t;
+}
+
+// Time of impact, as a fraction of the move, with the nearest sphere.
+// Returns a value outside [0, 1] if no sphere is hit.
+float sphereTimeOfImpact(const struct ParticleState* particle, const float move[3]) {
+    float contactRadiusSquared = (scene->sphereRadius * scene->sphereRadius) + 0.1;
+    float a = move[X] * move[X] + move[Y] * move[Y] + move[Z] * move[Z];
+    float nearest = -1.0;
+
+    for (int i = 0; i < scene->sphereCount; i++) {
+        float ox = particle->px - scene->spheres[i].center[X];
+        float oy = particle->py - scene->spheres[i].center[Y];
+        float oz = particle->pz - scene->spheres[i].center[Z];
+        float b = 2.0 * (move[X] * ox + move[Y] * oy + move[Z] * oz);
+        float c = ox * ox + oy * oy + oz * oz - contactRadiusSquared;
+        float t;
 
-            if (currentNode->next != NULL) {
-                currentNode->next->prev = currentNode->prev;
+        if (c < 0.0) {
+            // Already inside: only a hit if still heading further in
+            if (b >= 0.0) {
+                continue;
             }
-            else {
-                // The node is the tail of the list
-                particleList.tail = currentNode->prev;
+            t = 0.0;
+        }
+        else {
+            float discriminant = b * b - 4.0 * a * c;
+            if (a == 0.0 || discriminant < 0.0) {
+                continue;
+            }
+            t = (-b - sqrtf(discriminant)) / (2.0 * a);
+            if (t < 0.0 || t > 1.0) {
+                continue;
             }
-
-            free(currentNode);
-            particleList.size--;
         }
 
-        currentNode = nextNode;
+        if (nearest < 0.0 || t < nearest) {
+            nearest = t;
+        }
     }
+    return nearest;
 }
 
-float squaredDistance(float x1, float y1, float z1, float x2, float y2, float z2) {
-    float dx = x1 - x2;
-    float dy = y1 - y2;
-    float dz = z1 - z2;
-    return dx * dx + dy * dy + dz * dz;
+void handleGroundCollision(struct ParticleState* particle) {
+    tickMetrics[METRIC_GROUND_COLLISIONS]++;
+    particle->py = GROUND_CONTACT_HEIGHT;
+    particle->dy = -particle->dy;  // Bounce back;
+    if (frictionMode == true) {
+        applyFriction(particle);    // Apply friction
+    }
 }
 
-void applyFriction(struct ParticleNode* node) {
-    node->particle.speed *= FRICTION_FACTOR;
-    node->particle.dx *= FRICTION_FACTOR;
-    node->particle.dy *= FRICTION_FACTOR;
-    node->particle.dz *= FRICTION_FACTOR;
-}
+void handleSphereCollision(struct ParticleState* particle) {
+    tickMetrics[METRIC_SPHERE_COLLISIONS]++;
 
-void handleGroundCollision(struct ParticleNode* node) {
-    if (node->particle.py < 0.1 && node->particle.py > -0.1 &&
-        isParticleWithinGroundExtents(&node->particle) &&
-        !isParticleWithinHoleExtents(&node->particle)) {
-        node->particle.py = 0.1;
-        node->particle.dy = -node->particle.dy;  // Bounce back;
-        if (frictionMode == true) {
-            applyFriction(node);    // Apply friction
-        }
+    // Bounce back (opposite direction)
+    particle->dx = -particle->dx;
+    particle->dy = -particle->dy;
+    particle->dz = -particle->dz;
+
+    // Apply friction
+    if (frictionMode == true) {
+        applyFriction(particle);
     }
-}
 
-void handleSphereCollision(struct ParticleNode* node) {
-    float minDistanceSquared = (SPHERE_RADIUS * SPHERE_RADIUS) + 0.1;  // Squared radius of the spheres
+    // Move the particle slightly away to prevent sticking
+    float offset = 0.05;
+    particle->px += offset * particle->dx;
+    particle->py += offset * particle->dy;
+    particle->pz += offset * particle->dz;
+}
 
-    // Center of first sphere
-    float sphere1CenterX = -10.0;
-    float sphere1CenterY = 2.0;
-    float sphere1CenterZ = -10.0;
+// Fraction of the move at which it crosses the triangle (Moller-Trumbore),
+// or a negative value if it misses
+float triangleTimeOfImpact(const struct Triangle* triangle, const float origin[3], const float move[3]) {
+    float p[3] = {
+        move[Y] * triangle->e2[Z] - move[Z] * triangle->e2[Y],
+        move[Z] * triangle->e2[X] - move[X] * triangle->e2[Z],
+        move[X] * triangle->e2[Y] - move[Y] * triangle->e2[X],
+    };
+    float det = triangle->e1[X] * p[X] + triangle->e1[Y] * p[Y] + triangle->e1[Z] * p[Z];
+    if (fabsf(det) < 1e-12) {
+        return -1.0;
+    }
 
-    // Center of second sphere
-    float sphere2CenterX = 5.0;
-    float sphere2CenterY = 2.0;
-    float sphere2CenterZ = -5.0;
+    float inverse = 1.0 / det;
+    float s[3] = { origin[X] - triangle->v0[X], origin[Y] - triangle->v0[Y], origin[Z] - triangle->v0[Z] };
+    float u = (s[X] * p[X] + s[Y] * p[Y] + s[Z] * p[Z]) * inverse;
+    if (u < 0.0 || u > 1.0) {
+        return -1.0;
+    }
 
-    // Squared distance to first sphere
-    float distance1Squared = squaredDistance(
-        node->particle.px, node->particle.py, node->particle.pz,
-        sphere1CenterX, sphere1CenterY, sphere1CenterZ);
+    float q[3] = {
+        s[Y] * triangle->e1[Z] - s[Z] * triangle->e1[Y],
+        s[Z] * triangle->e1[X] - s[X] * triangle->e1[Z],
+        s[X] * triangle->e1[Y] - s[Y] * triangle->e1[X],
+    };
+    float v = (move[X] * q[X] + move[Y] * q[Y] + move[Z] * q[Z]) * inverse;
+    if (v < 0.0 || u + v > 1.0) {
+        return -1.0;
+    }
+    return (triangle->e2[X] * q[X] + triangle->e2[Y] * q[Y] + triangle->e2[Z] * q[Z]) * inverse;
+}
 
-    // Squared distance to second sphere
-    float distance2Squared = squaredDistance(
-        node->particle.px, node->particle.py, node->particle.pz,
-        sphere2CenterX, sphere2CenterY, sphere2CenterZ);
+// Whether the move, up to fraction limit, passes through the node's bounds
+bool segmentHitsBox(const struct BvhNode* node, const float origin[3], const float inverse[3], float limit) {
+    float enter = 0.0;
+    float exit = limit;
+    for (int axis = 0; axis < 3; axis++) {
+        float t1 = (node->lo[axis] - origin[axis]) * inverse[axis];
+        float t2 = (node->hi[axis] - origin[axis]) * inverse[axis];
+        enter = fmaxf(enter, fminf(t1, t2));
+        exit = fminf(exit, fmaxf(t1, t2));
+    }
+    return enter <= exit;
+}
 
-    if (distance1Squared < minDistanceSquared || distance2Squared < minDistanceSquared) {
-        // Particle is inside a sphere, handle collision
+// Time of impact, as a fraction of the move, with the nearest mesh
+// triangle, whose normal is stored in normal. Returns a value outside
+// [0, 1] if no mesh is hit.
+float meshTimeOfImpact(const struct ParticleState* particle, const float move[3], float normal[3]) {
+    const struct MeshGeometry* geometry = scene->geometry;
+    if (geometry == NULL) {
+        return -1.0;
+    }
 
-        // Bounce back (opposite direction)
-        node->particle.dx = -node->particle.dx;
-        node->particle.dy = -node->particle.dy;
-        node->particle.dz = -node->particle.dz;
+    float origin[3] = { particle->px, particle->py, particle->pz };
+    float inverse[3] = { 1.0 / move[X], 1.0 / move[Y], 1.0 / move[Z] };
+    float nearest = 1.0;
+    bool hit = false;
 
-        // Apply friction
-        if (frictionMode == true) {
-            applyFriction(node);
+    int stack[BVH_MAX_DEPTH + 2];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const struct BvhNode* node = &geometry->nodes[stack[--top]];
+        if (!segmentHitsBox(node, origin, inverse, nearest)) {
+            continue;
+        }
+        if (node->count == 0) {
+            stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+            continue;
         }
 
-        // Move the particle slightly away to prevent sticking
-        float offset = 0.05;
-        node->particle.px += offset * node->particle.dx;
-        node->particle.py += offset * node->particle.dy;
-        node->particle.pz += offset * node->particle.dz;
+        for (int i = node->first; i < node->first + node->count; i++) {
+            float t = triangleTimeOfImpact(&geometry->triangles[i], origin, move);
+            if (t >= 0.0 && t <= nearest) {
+                nearest = t;
+                memcpy(normal, geometry->triangles[i].normal, 3 * sizeof(float));
+                hit = true;
+            }
+        }
     }
+    return hit ? nearest : -1.0;
 }
 
-// Update particle position and state
-void updateParticle(struct ParticleNode* node) {
-    if (node->particle.active) {
-        // Apply gravity
-        node->particle.dy += GRAVITY;
+// Reflect the particle off the mesh surface with the given normal and move
+// it slightly away to prevent sticking
+void handleMeshCollision(struct ParticleState* particle, const float normal[3]) {
+    tickMetrics[METRIC_MESH_COLLISIONS]++;
 
-        // Update position based on direction and speed
-        node->particle.px += node->particle.dx * node->particle.speed * SPEED_FACTOR;
-        node->particle.py += node->particle.dy * node->particle.speed * SPEED_FACTOR;
-        node->particle.pz += node->particle.dz * node->particle.speed * SPEED_FACTOR;
+    // Meshes are two-sided: bounce off whichever side was hit
+    float into = particle->dx * normal[X] + particle->dy * normal[Y] + particle->dz * normal[Z];
+    float side = into > 0.0 ? -1.0 : 1.0;
+    particle->dx -= 2.0 * into * normal[X];
+    particle->dy -= 2.0 * into * normal[Y];
+    particle->dz -= 2.0 * into * normal[Z];
+    if (frictionMode == true) {
+        applyFriction(particle);
+    }
 
-        // Check for collision with ground
-        handleGroundCollision(node);             
+    particle->px += side * MESH_CONTACT_OFFSET * normal[X];
+    particle->py += side * MESH_CONTACT_OFFSET * normal[Y];
+    particle->pz += side * MESH_CONTACT_OFFSET * normal[Z];
+}
 
-        // Check for collision with the spheres
-        handleSphereCollision(node);
+// Distance from the position to the nearest collider and the unit
+// direction away from it, interpolated trilinearly from the grid. Outside
+// the grid the colliders are at least SDF_MARGIN further than the edge.
+void sampleDistanceGrid(const struct DistanceGrid* grid, const float position[3], float sample[4]) {
+    int cell[3];
+    float t[3];
+    float outside[3];
+    for (int axis = 0; axis < 3; axis++) {
+        float g = (position[axis] - grid->origin[axis]) / grid->cellSize;
+        float clamped = fminf(fmaxf(g, 0.0), grid->size[axis] - 1);
+        outside[axis] = (g - clamped) * grid->cellSize;
+        cell[axis] = (int)fminf(clamped, grid->size[axis] - 2);
+        t[axis] = clamped - cell[axis];
+    }
 
-        // Delete particle if it becomes stationary
-        if (node->particle.speed < 0.1) {
-            node->particle.active = false;
+    float away = sqrtf(outside[X] * outside[X] + outside[Y] * outside[Y] + outside[Z] * outside[Z]);
+    if (away > 0.0) {
+        sample[0] = away + SDF_MARGIN;
+        for (int axis = 0; axis < 3; axis++) {
+            sample[1 + axis] = outside[axis] / away;
         }
+        return;
+    }
 
-        // Check for death conditions
-        if (node->particle.py < -75.0) {
-            node->particle.active = false;
-        }              
+    const float* corner = &grid->samples[((cell[Z] * grid->size[Y] + cell[Y]) * grid->size[X] + cell[X]) * 4];
+    int dy = grid->size[X] * 4;
+    int dz = grid->size[Y] * dy;
+    for (int channel = 0; channel < 4; channel++) {
+        float c00 = lerp(corner[channel], corner[4 + channel], t[X]);
+        float c10 = lerp(corner[dy + channel], corner[dy + 4 + channel], t[X]);
+        float c01 = lerp(corner[dz + channel], corner[dz + 4 + channel], t[X]);
+        float c11 = lerp(corner[dz + dy + channel], corner[dz + dy + 4 + channel], t[X]);
+        sample[channel] = lerp(lerp(c00, c10, t[Y]), lerp(c01, c11, t[Y]), t[Z]);
+    }
 
-        // Apply random spin mode
-        if (randomSpinMode) {
-            node->particle.angleX += node->particle.dAngleX;
-            node->particle.angleY += node->particle.dAngleY;
-            node->particle.angleZ += node->particle.dAngleZ;
+    float length = sqrtf(sample[1] * sample[1] + sample[2] * sample[2] + sample[3] * sample[3]);
+    if (length > 0.0) {
+        sample[1] /= length;
+        sample[2] /= length;
+        sample[3] /= length;
+    }
+}
 
-            // Ensure angles are between 0 to 360 degrees
-            node->particle.angleX = fmod(node->particle.angleX, 360.0);
-            node->particle.angleY = fmod(node->particle.angleY, 360.0);
-            node->particle.angleZ = fmod(node->particle.angleZ, 360.0);
-        }
-    } 
+// Push the particle out of a baked collider along the gradient and reflect
+// its direction off the surface
+void handleDistanceGridCollision(struct ParticleState* particle, const float sample[4]) {
+    tickMetrics[METRIC_SDF_COLLISIONS]++;
+    const float* normal = &sample[1];
+    float depth = GROUND_CONTACT_HEIGHT - sample[0];
+    particle->px += normal[X] * depth;
+    particle->py += normal[Y] * depth;
+    particle->pz += normal[Z] * depth;
+
+    float into = particle->dx * normal[X] + particle->dy * normal[Y] + particle->dz * normal[Z];
+    particle->dx -= 2.0 * into * normal[X];
+    particle->dy -= 2.0 * into * normal[Y];
+    particle->dz -= 2.0 * into * normal[Z];
+    if (frictionMode == true) {
+        applyFriction(particle);
+    }
 }
 
-// Render the particle
-void renderParticle(struct ParticleNode* node) {
-    if (node->particle.active) {
-        glPushMatrix();
-        glTranslatef(node->particle.px, node->particle.py, node->particle.pz);
-        glRotatef(node->particle.angleX, 1.0, 0.0, 0.0);
-        glRotatef(node->particle.angleY, 0.0, 1.0, 0.0);
-        glRotatef(node->particle.angleZ, 0.0, 0.0, 1.0);
-
-        GLfloat mat_ambient_diffuse[] = { node->particle.color[0], 
-            node->particle.color[1], node->particle.color[2], 1.0 };
-        GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-        GLfloat mat_shininess[] = { 60.0 };
-
-        glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, mat_ambient_diffuse);
-        glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-        glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-
-        glColor3fv(node->particle.color);
-
-        switch (currentRenderMode) {
-        // points mode
-        case 1:
-            glBegin(GL_POINTS);
-            glVertex3f(0.0, 0.0, 0.0);
-            glEnd();
-            break;
-        // wireframe mode
-        case 2:
-            glBegin(GL_LINES);
-            // Front face
-            glVertex3f(-0.1, -0.1, 0.1);
-            glVertex3f(0.1, -0.1, 0.1);
-            glVertex3f(0.1, -0.1, 0.1);
-            glVertex3f(0.1, 0.1, 0.1);
-            glVertex3f(0.1, 0.1, 0.1);
-            glVertex3f(-0.1, 0.1, 0.1);
-            glVertex3f(-0.1, 0.1, 0.1);
-            glVertex3f(-0.1, -0.1, 0.1);
-            // Back face
-            glVertex3f(-0.1, -0.1, -0.1);
-            glVertex3f(0.1, -0.1, -0.1);
-            glVertex3f(0.1, -0.1, -0.1);
-            glVertex3f(0.1, 0.1, -0.1);
-            glVertex3f(0.1, 0.1, -0.1);
-            glVertex3f(-0.1, 0.1, -0.1);
-            glVertex3f(-0.1, 0.1, -0.1);
-            glVertex3f(-0.1, -0.1, -0.1);
-            // Connecting lines
-            glVertex3f(-0.1, -0.1, 0.1);
-            glVertex3f(-0.1, -0.1, -0.1);
-            glVertex3f(0.1, -0.1, 0.1);
-            glVertex3f(0.1, -0.1, -0.1);
-            glVertex3f(0.1, 0.1, 0.1);
-            glVertex3f(0.1, 0.1, -0.1);
-            glVertex3f(-0.1, 0.1, 0.1);
-            glVertex3f(-0.1, 0.1, -0.1);
-            glEnd();
-            break;
-        // solid mode
-        case 3:
-            // Front face
-            glBegin(GL_POLYGON);
-            //glNormal3f(0.0, 0.0, 1.0); // Normal for the front face
-            glNormal3f(-0.5774, -0.5774, 0.5774);
-            glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Bottom left)
-            glNormal3f(0.5774, -0.5774, 0.5774);
-            glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Bottom right)
-            glNormal3f(0.5774, 0.5774, 0.5774);
-            glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Top right)
-            glNormal3f(-0.5774, 0.5774, 0.5774);
-            glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Top left)
-            glEnd();
-
-            // Back face
-            glBegin(GL_POLYGON);
-            //glNormal3f(0.0, 0.0, -1.0); // Normal for the back face
-            glNormal3f(0.5774, 0.5774, -0.5774);
-            glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Top right)
-            glNormal3f(0.5774, -0.5774, -0.5774);
-            glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Bottom right)
-            glNormal3f(-0.5774, -0.5774, -0.5774);
-            glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Bottom left)
-            glNormal3f(-0.5774, 0.5774, -0.5774);
-            glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Top left)
-            glEnd();
-
-            // Right face
-            glBegin(GL_POLYGON);
-            //glNormal3f(1.0, 0.0, 0.0); // Normal for the right face
-            glNormal3f(0.5774, -0.5774, 0.5774);
-            glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Bottom front)
-            glNormal3f(0.5774, -0.5774, -0.5774);
-            glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Bottom back)
-            glNormal3f(0.5774, 0.5774, -0.5774);
-            glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Top back)
-            glNormal3f(0.5774, 0.5774, 0.5774);
-            glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Top front)
-            glEnd();
-
-            // Left face
-            glBegin(GL_POLYGON);
-            //glNormal3f(-1.0, 0.0, 0.0); // Normal for the left face
-            glNormal3f(-0.5774, 0.5774, 0.5774);
-            glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Top front)
-            glNormal3f(-0.5774, 0.5774, -0.5774);
-            glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Top back)
-            glNormal3f(-0.5774, -0.5774, -0.5774);
-            glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Bottom back)
-            glNormal3f(-0.5774, -0.5774, 0.5774);
-            glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Bottom front)
-            glEnd();
-
-            // Top face
-            glBegin(GL_POLYGON);
-            //glNormal3f(0.0, 1.0, 0.0); // Normal for the top face
-            glNormal3f(-0.5774, 0.5774, 0.5774);
-            glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Front left)
-            glNormal3f(0.5774, 0.5774, 0.5774);
-            glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Front right)
-            glNormal3f(0.5774, 0.5774, -0.5774);
-            glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Back right)
-            glNormal3f(-0.5774, 0.5774, -0.5774);
-            glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Back left)
-            glEnd();
-
-            // Bottom face
-            glBegin(GL_POLYGON);
-            //glNormal3f(0.0, -1.0, 0.0); // Normal for the bottom face
-            glNormal3f(-0.5774, -0.5774, -0.5774);
-            glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Back left)
-            glNormal3f(0.5774, -0.5774, -0.5774);
-            glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Back right)
-            glNormal3f(0.5774, -0.5774, 0.5774);
-            glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Front right)
-            glNormal3f(-0.5774, -0.5774, 0.5774);
-            glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Front left)
-            glEnd();
+// Move the particle along its path for dt ticks through the scene's distance
+// grid. Each lookup gives the room there is to move without touching a
+// collider, so a particle clear of them covers the whole move after one
+// lookup; nearer, the move is marched in steps of that room and cannot pass
+// through a surface. Steps are at least half a cell, below what the grid
+// resolves, so particles sliding along a surface do not crawl.
+void moveParticleThroughDistanceGrid(struct ParticleState* particle, float dt) {
+    const struct DistanceGrid* grid = scene->sdf;
+    float remaining = 1.0;
+
+    for (int i = 0; i < 2 * MAX_COLLISION_ITERATIONS && remaining > 0.0; i++) {
+        float position[3] = { particle->px, particle->py, particle->pz };
+        float sample[4];
+        sampleDistanceGrid(grid, position, sample);
+
+        float room = sample[0] - GROUND_CONTACT_HEIGHT;
+        float into = particle->dx * sample[1] + particle->dy * sample[2] + particle->dz * sample[3];
+        if (room <= 0.0 && into < 0.0) {
+            handleDistanceGridCollision(particle, sample);
+            continue;
+        }
+
+        float step = particle->speed * scene->speedFactor * dt;
+        float move[3] = { particle->dx * step, particle->dy * step, particle->dz * step };
+        float length = sqrtf(move[X] * move[X] + move[Y] * move[Y] + move[Z] * move[Z]);
+        if (length == 0.0) {
             break;
         }
+        float t = fminf(fmaxf(room, 0.5 * grid->cellSize) / length, remaining);
 
-        glPopMatrix();
+        // Meshes are not baked into the grid and are tested along the step
+        float segment[3] = { move[X] * t, move[Y] * t, move[Z] * t };
+        float normal[3];
+        float tMesh = meshTimeOfImpact(particle, segment, normal);
+        if (tMesh >= 0.0) {
+            t *= tMesh;
+        }
+
+        particle->px += move[X] * t;
+        particle->py += move[Y] * t;
+        particle->pz += move[Z] * t;
+        remaining -= t;
+        if (tMesh >= 0.0) {
+            handleMeshCollision(particle, normal);
+        }
     }
 }
 
-// Update the entire frame
-void updateFrame() {
-    struct ParticleNode* currentNode = particleList.head;
-
-    while (currentNode != NULL) {
-        updateParticle(currentNode);
-        currentNode = currentNode->next;
+// Move the particle along its path for dt ticks, stopping at the first
+// collision and continuing from there with what is left of the step, so
+// fast particles and large timesteps cannot tunnel through the colliders
+void moveParticle(struct ParticleState* particle, float dt) {
+    if (scene->sdf != NULL) {
+        moveParticleThroughDistanceGrid(particle, dt);
+        return;
     }
 
-    removeInactiveParticles();
+    float remaining = 1.0;
 
-    glutPostRedisplay();
-}
+    for (int i = 0; i < MAX_COLLISION_ITERATIONS && remaining > 0.0; i++) {
+        float step = particle->speed * scene->speedFactor * dt * remaining;
+        float move[3] = { particle->dx * step, particle->dy * step, particle->dz * step };
 
-// Render ground and hole
-void renderGround() {
-    GLfloat mat_ambient[] = { 0.0, 0.0, 0.0, 0.0 };
-    GLfloat mat_diffuse[] = { 1.0, 1.0, 1.0, 1.0 }; 
-    GLfloat mat_specular[] = { 0.0, 0.0, 0.0, 1.0 };
+        float meshNormal[3];
+        float tGround = groundTimeOfImpact(particle, move);
+        float tSphere = sphereTimeOfImpact(particle, move);
+        float tMesh = meshTimeOfImpact(particle, move, meshNormal);
+        bool hitGround = tGround >= 0.0 && (tSphere < 0.0 || tGround <= tSphere) && (tMesh < 0.0 || tGround <= tMesh);
+        bool hitSphere = !hitGround && tSphere >= 0.0 && (tMesh < 0.0 || tSphere <= tMesh);
+        bool hitMesh = !hitGround && !hitSphere && tMesh >= 0.0;
+        float t = hitGround ? tGround : hitSphere ? tSphere : hitMesh ? tMesh : 1.0;
 
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialf(GL_FRONT, GL_SHININESS, 0.0);
+        particle->px += move[X] * t;
+        particle->py += move[Y] * t;
+        particle->pz += move[Z] * t;
+        remaining *= 1.0 - t;
 
-    glNormal3f(0.0, 1.0, 0.0);
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(-GROUND_SIZE, 0.0, -GROUND_SIZE);
-    glVertex3f(-GROUND_SIZE, 0.0, 0.0);
-    glVertex3f(GROUND_SIZE, 0.0, 0.0);
-    glVertex3f(GROUND_SIZE, 0.0, -GROUND_SIZE);
-    glEnd();
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(-GROUND_SIZE, 0.0, 0.0);
-    glVertex3f(-GROUND_SIZE, 0.0, GROUND_SIZE);
-    glVertex3f(0.0, 0.0, GROUND_SIZE);
-    glVertex3f(0.0, 0.0, 0.0);
-    glEnd();
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(0.0, 0.0, 0.0);
-    glVertex3f(0.0, 0.0, 5.0);
-    glVertex3f(GROUND_SIZE, 0.0, 5.0);
-    glVertex3f(GROUND_SIZE, 0.0, 0.0);
-    glEnd();
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(0.0, 0.0, 5.0);
-    glVertex3f(0.0, 0.0, 10.0);
-    glVertex3f(5.0, 0.0, 10.0);
-    glVertex3f(5.0, 0.0, 5.0);
-    glEnd();
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(10.0, 0.0, 5.0);
-    glVertex3f(10.0, 0.0, 10.0);
-    glVertex3f(GROUND_SIZE, 0.0, 10.0);
-    glVertex3f(GROUND_SIZE, 0.0, 5.0);
-    glEnd();
-
-    glBegin(GL_POLYGON);
-    glColor3f(0.5, 0.5, 0.5);
-    glVertex3f(0.0, 0.0, 10.0);
-    glVertex3f(0.0, 0.0, GROUND_SIZE);
-    glVertex3f(GROUND_SIZE, 0.0, GROUND_SIZE);
-    glVertex3f(GROUND_SIZE, 0.0, 10.0);
-    glEnd();
-}
+        if (hitGround) {
+            handleGroundCollision(particle);
+        }
+        else if (hitSphere) {
+            handleSphereCollision(particle);
+        }
+        else if (hitMesh) {
+            handleMeshCollision(particle, meshNormal);
+        }
+        else {
+            break;
+        }
+    }
+}
+
+// Particles gathered for the force-field pass. Positions and accelerations
+// are kept as one array per axis so each field runs as a tight loop.
+struct FieldBlock {
+    int count;
+    unsigned int seq[FIELD_BLOCK_SIZE];
+    float position[3][FIELD_BLOCK_SIZE];
+    float acceleration[3][FIELD_BLOCK_SIZE];
+};
+
+// Acceleration of a field towards centre c, softened inside radius r:
+// strength * (c - p) * r^2 / (|c - p|^2 + r^2)^1.5, which falls off with
+// the inverse square far out and vanishes at the centre
+void sampleAttractor(const struct ForceField* field, struct FieldBlock* block) {
+    float r2 = field->radius * field->radius;
+    float scale = field->strength * r2;
+    for (int i = 0; i < block->count; i++) {
+        float ox = field->position[X] - block->position[X][i];
+        float oy = field->position[Y] - block->position[Y][i];
+        float oz = field->position[Z] - block->position[Z][i];
+        float d2 = ox * ox + oy * oy + oz * oz + r2;
+        float f = scale / (d2 * sqrtf(d2));
+        block->acceleration[X][i] += f * ox;
+        block->acceleration[Y][i] += f * oy;
+        block->acceleration[Z][i] += f * oz;
+    }
+}
+
+// Tangential acceleration axis x (p - c), strongest at radius r from the axis
+void sampleVortex(const struct ForceField* field, struct FieldBlock* block) {
+    const float* axis = field->vector;
+    float r2 = field->radius * field->radius;
+    float scale = field->strength * field->radius;
+    for (int i = 0; i < block->count; i++) {
+        float ox = block->position[X][i] - field->position[X];
+        float oy = block->position[Y][i] - field->position[Y];
+        float oz = block->position[Z][i] - field->position[Z];
+        float along = ox * axis[X] + oy * axis[Y] + oz * axis[Z];
+        float f = scale / (ox * ox + oy * oy + oz * oz - along * along + r2);
+        block->acceleration[X][i] += f * (axis[Y] * oz - axis[Z] * oy);
+        block->acceleration[Y][i] += f * (axis[Z] * ox - axis[X] * oz);
+        block->acceleration[Z][i] += f * (axis[X] * oy - axis[Y] * ox);
+    }
+}
+
+// Each component varies only along the other two axes, so the field has no
+// divergence and swirls particles without bunching them up
+void sampleTurbulence(const struct ForceField* field, struct FieldBlock* block) {
+    float k = 2.0 * M_PI / field->radius;
+    float phase = (float)fmod(simTime * field->drift, 1.0) * 2.0 * M_PI;
+    for (int i = 0; i < block->count; i++) {
+        float x = k * block->position[X][i];
+        float y = k * block->position[Y][i];
+        float z = k * block->position[Z][i];
+        block->acceleration[X][i] += field->strength * sinf(y + phase) * cosf(1.3 * z);
+        block->acceleration[Y][i] += field->strength * sinf(z + phase) * cosf(1.3 * x);
+        block->acceleration[Z][i] += field->strength * sinf(x + phase) * cosf(1.3 * y);
+    }
+}
+
+// Trilinear interpolation of the baked grid. Outside its box a grid exerts
+// no force.
+void sampleGrid(const struct ForceField* field, struct FieldBlock* block) {
+    const int* size = field->size;
+    float scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        scale[axis] = (size[axis] - 1) / (field->vector[axis] - field->position[axis]);
+    }
+
+    for (int i = 0; i < block->count; i++) {
+        int cell[3];
+        float t[3];
+        bool inside = true;
+        for (int axis = 0; axis < 3; axis++) {
+            float g = (block->position[axis][i] - field->position[axis]) * scale[axis];
+            inside = inside && g >= 0.0 && g <= size[axis] - 1;
+            cell[axis] = (int)fminf(fmaxf(g, 0.0), size[axis] - 2);
+            t[axis] = fminf(fmaxf(g - cell[axis], 0.0), 1.0);
+        }
+        if (!inside) {
+            continue;
+        }
+
+        const float* corner = &field->grid[((cell[Z] * size[Y] + cell[Y]) * size[X] + cell[X]) * 3];
+        int dy = size[X] * 3;
+        int dz = size[Y] * dy;
+        for (int axis = 0; axis < 3; axis++) {
+            float c00 = lerp(corner[axis], corner[3 + axis], t[X]);
+            float c10 = lerp(corner[dy + axis], corner[dy + 3 + axis], t[X]);
+            float c01 = lerp(corner[dz + axis], corner[dz + 3 + axis], t[X]);
+            float c11 = lerp(corner[dz + dy + axis], corner[dz + dy + 3 + axis], t[X]);
+            block->acceleration[axis][i] += lerp(lerp(c00, c10, t[Y]), lerp(c01, c11, t[Y]), t[Z]);
+        }
+    }
+}
+
+// Sum the accelerations of the scene's force fields at the block's
+// positions, one pass over the block per field
+void sampleForceFields(struct FieldBlock* block) {
+    for (int axis = 0; axis < 3; axis++) {
+        memset(block->acceleration[axis], 0, block->count * sizeof(float));
+    }
+
+    for (int f = 0; f < scene->fieldCount; f++) {
+        const struct ForceField* field = &scene->fields[f];
+        switch (field->type) {
+        case FIELD_WIND:
+            for (int axis = 0; axis < 3; axis++) {
+                for (int i = 0; i < block->count; i++) {
+                    block->acceleration[axis][i] += field->vector[axis];
+                }
+            }
+            break;
+        case FIELD_ATTRACTOR:
+            sampleAttractor(field, block);
+            break;
+        case FIELD_VORTEX:
+            sampleVortex(field, block);
+            break;
+        case FIELD_TURBULENCE:
+            sampleTurbulence(field, block);
+            break;
+        case FIELD_GRID:
+            sampleGrid(field, block);
+            break;
+        }
+    }
+}
+
+// Merge a slow particle resting on the ground into the deposit, splatting
+// its height and colour over the four heightfield vertices around it.
+// Returns whether it was merged, and so has died.
+bool depositParticle(const struct Particle* particle, const struct ParticleState* state) {
+    if (!depositionMode || state->speed >= DEPOSIT_SPEED ||
+        fabs(state->py - GROUND_CONTACT_HEIGHT) > DEPOSIT_CONTACT_MARGIN ||
+        !isParticleWithinGroundExtents(state) || isParticleWithinHoleExtents(state)) {
+        return false;
+    }
+
+    float cell = 2.0 * scene->groundSize / (DEPOSIT_RESOLUTION - 1);
+    float u = (state->px + scene->groundSize) / cell;
+    float v = (state->pz + scene->groundSize) / cell;
+    int i0 = (int)fminf(u, DEPOSIT_RESOLUTION - 2);
+    int j0 = (int)fminf(v, DEPOSIT_RESOLUTION - 2);
+    float fu = u - i0;
+    float fv = v - j0;
+    float weights[4] = { (1.0 - fu) * (1.0 - fv), fu * (1.0 - fv), (1.0 - fu) * fv, fu * fv };
+
+    for (int k = 0; k < 4; k++) {
+        int i = i0 + (k & 1);
+        int j = j0 + (k >> 1);
+        int index = j * DEPOSIT_RESOLUTION + i;
+
+        // Vertices over the hole stay flat so the deposit does not cover it
+        struct ParticleState vertex = { .px = i * cell - scene->groundSize, .pz = j * cell - scene->groundSize };
+        float added = fminf(DEPOSIT_HEIGHT * weights[k], DEPOSIT_MAX_HEIGHT - deposit.height[index]);
+        if (added <= 0.0 || isParticleWithinHoleExtents(&vertex)) {
+            continue;
+        }
+        deposit.height[index] += added;
+        for (int c = 0; c < 3; c++) {
+            deposit.color[index][c] += added * particle->color[c];
+        }
+    }
+    deposit.version++;
+    tickMetrics[METRIC_DEATHS_DEPOSITED]++;
+    return true;
+}
+
+// Add the force fields' acceleration over dt ticks to the direction. The
+// packed direction only holds whole steps, so what is left over on each axis
+// is carried in the particle to its next update instead of being rounded
+// away: weak fields build up to whole steps over several updates, and act
+// alike whether a particle is updated every tick or in coarser LOD steps.
+void addFieldAcceleration(struct Particle* particle, struct ParticleState* state, float dt, const float acceleration[3]) {
+    float* direction[3] = { &state->dx, &state->dy, &state->dz };
+    unsigned short remainders = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        long carried = (particle->fieldRemainder >> (axis * 5)) & (FIELD_REMAINDER_STEPS - 1);
+        long total = lrintf(acceleration[axis] * dt * (float)(DIRECTION_SCALE * FIELD_REMAINDER_STEPS)) + carried;
+        long remainder = (total % FIELD_REMAINDER_STEPS + FIELD_REMAINDER_STEPS) % FIELD_REMAINDER_STEPS;
+        *direction[axis] += (total - remainder) / FIELD_REMAINDER_STEPS / DIRECTION_SCALE;
+        remainders |= (unsigned short)(remainder << (axis * 5));
+    }
+    particle->fieldRemainder = remainders;
+}
+
+// Update particle position and state over dt timer ticks, under gravity and
+// the given force-field acceleration. Returns false once the particle has died.
+bool integrateParticle(struct Particle* particle, float dt, const float acceleration[3]) {
+    struct ParticleState state;
+    unpackParticle(particle, &state);
+
+    // Apply gravity and the force fields
+    state.dy += scene->gravity * dt;
+    if (scene->fieldCount > 0) {
+        addFieldAcceleration(particle, &state, dt, acceleration);
+    }
+
+    // Update position, resolving ground and sphere collisions on the way
+    moveParticle(&state, dt);
+    packParticle(particle, &state);
+
+    // Apply random spin mode
+    if (randomSpinMode) {
+        spinParticle(particle, dt);
+    }
+
+    // Delete particle if it becomes stationary, or on other death conditions
+    if (depositParticle(particle, &state)) {
+        return false;
+    }
+    if (state.speed < 0.1) {
+        tickMetrics[METRIC_DEATHS_STOPPED]++;
+        return false;
+    }
+    if (state.py < DEATH_HEIGHT) {
+        tickMetrics[METRIC_DEATHS_FELL]++;
+        return false;
+    }
+    return true;
+}
+
+// Update a single particle over dt timer ticks, sampling the force fields
+// at its position. Returns false once the particle has died.
+bool updateParticle(struct Particle* particle, float dt) {
+    float acceleration[3] = { 0.0, 0.0, 0.0 };
+    if (scene->fieldCount > 0) {
+        struct FieldBlock block;
+        block.count = 1;
+        block.position[X][0] = particle->px;
+        block.position[Y][0] = particle->py;
+        block.position[Z][0] = particle->pz;
+        sampleForceFields(&block);
+        for (int axis = 0; axis < 3; axis++) {
+            acceleration[axis] = block.acceleration[axis][0];
+        }
+    }
+    return integrateParticle(particle, dt, acceleration);
+}
+
+// Particle state tau ticks after its launch state, following the closed-form
+// parabola. Only meaningful in event-driven and LOD modes.
+struct Particle evaluateParticle(const struct Particle* particle, float tau) {
+    struct Particle evaluated = *particle;
+    struct ParticleState state;
+    unpackParticle(particle, &state);
+
+    float k = state.speed * scene->speedFactor;
+    state.px += k * state.dx * tau;
+    state.py += k * (state.dy * tau + 0.5 * scene->gravity * tau * tau);
+    state.pz += k * state.dz * tau;
+    state.dy += scene->gravity * tau;
+    packParticle(&evaluated, &state);
+
+    if (randomSpinMode) {
+        spinParticle(&evaluated, tau);
+    }
+    return evaluated;
+}
+
+// Time after launch at which the particle descends through height h, or a
+// negative value if it never does
+float descentTime(const struct ParticleState* particle, float h) {
+    float k = particle->speed * scene->speedFactor;
+    float a = 0.5 * scene->gravity * k;
+    float b = particle->dy * k;
+    float c = particle->py - h;
+    float discriminant = b * b - 4.0 * a * c;
+
+    if (discriminant < 0.0) {
+        return -1.0;
+    }
+    // With gravity pointing down the larger root is the descending crossing
+    return (-b - sqrtf(discriminant)) / (2.0 * a);
+}
+
+// Time after launch at which the particle's horizontal path enters the x, z
+// rectangle from lo to hi, 0 if already inside, or a negative value if it
+// never does
+float footprintEntryTime(const float position[2], const float velocity[2], const float lo[2], const float hi[2]) {
+    float enter = 0.0;
+    float exit = INFINITY;
+
+    // Intersect the slab intervals on x and z
+    for (int axis = 0; axis < 2; axis++) {
+        float near = lo[axis] - position[axis];
+        float far = hi[axis] - position[axis];
+        if (velocity[axis] == 0.0) {
+            if (near > 0.0 || far < 0.0) {
+                exit = -1.0;
+            }
+            continue;
+        }
+        float t1 = near / velocity[axis];
+        float t2 = far / velocity[axis];
+        enter = fmaxf(enter, fminf(t1, t2));
+        exit = fminf(exit, fmaxf(t1, t2));
+    }
+    return enter <= exit ? enter : -1.0;
+}
+
+// Time after launch at which the particle enters the horizontal bounds of a
+// sphere or mesh, 0 if already inside, or a negative value if it never does
+float colliderBoundsEntryTime(const struct ParticleState* particle) {
+    float k = particle->speed * scene->speedFactor;
+    float r = sqrtf((scene->sphereRadius * scene->sphereRadius) + 0.1);
+    float velocity[2] = { k * particle->dx, k * particle->dz };
+    float position[2] = { particle->px, particle->pz };
+    float nearest = -1.0;
+
+    for (int i = 0; i < scene->sphereCount + scene->meshCount; i++) {
+        float lo[2];
+        float hi[2];
+        if (i < scene->sphereCount) {
+            const float* center = scene->spheres[i].center;
+            lo[0] = center[X] - r;
+            lo[1] = center[Z] - r;
+            hi[0] = center[X] + r;
+            hi[1] = center[Z] + r;
+        }
+        else {
+            const struct Mesh* mesh = &scene->meshes[i - scene->sphereCount];
+            lo[0] = mesh->lo[X] - MESH_CONTACT_OFFSET;
+            lo[1] = mesh->lo[Z] - MESH_CONTACT_OFFSET;
+            hi[0] = mesh->hi[X] + MESH_CONTACT_OFFSET;
+            hi[1] = mesh->hi[Z] + MESH_CONTACT_OFFSET;
+        }
+
+        float enter = footprintEntryTime(position, velocity, lo, hi);
+        if (enter >= 0.0 && (nearest < 0.0 || enter < nearest)) {
+            nearest = enter;
+        }
+    }
+    return nearest;
+}
+
+// Predict the particle's next event from its launch state. Returns the time
+// from launch to the event.
+float predictParticleEvent(struct Particle* particle) {
+    // Force fields and baked colliders have no closed form, so particles
+    // are stepped through them
+    if (scene->fieldCount > 0 || scene->sdf != NULL) {
+        particle->eventType = EVENT_STEP;
+        return 1.0;
+    }
+
+    struct ParticleState state;
+    unpackParticle(particle, &state);
+
+    float tDeath = descentTime(&state, DEATH_HEIGHT);
+    float tNext = tDeath;
+    particle->eventType = EVENT_DEATH;
+
+    float tGround = descentTime(&state, GROUND_CONTACT_HEIGHT);
+    if (tGround >= 0.0 && tGround < tNext) {
+        float k = state.speed * scene->speedFactor;
+        struct ParticleState impact = state;
+        impact.px += k * state.dx * tGround;
+        impact.pz += k * state.dz * tGround;
+        if (isParticleWithinGroundExtents(&impact) && !isParticleWithinHoleExtents(&impact)) {
+            tNext = tGround;
+            particle->eventType = EVENT_GROUND;
+        }
+    }
+
+    // Near a sphere or mesh the particle is integrated tick by tick with
+    // swept collision
+    float tSphere = colliderBoundsEntryTime(&state);
+    if (tSphere == 0.0) {
+        tNext = 1.0;
+        particle->eventType = EVENT_STEP;
+    }
+    else if (tSphere > 0.0 && tSphere < tNext) {
+        tNext = tSphere;
+        particle->eventType = EVENT_SPHERE;
+    }
+
+    return fmaxf(tNext, EVENT_MIN_INTERVAL);
+}
+
+void eventQueuePush(unsigned int seq) {
+    if (eventQueue.size == eventQueue.capacity) {
+        int capacity = eventQueue.capacity == 0 ? 256 : eventQueue.capacity * 2;
+        struct ParticleEvent* events = (struct ParticleEvent*)realloc(eventQueue.events,
+            capacity * sizeof(struct ParticleEvent));
+        if (events == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for the event queue.\n");
+            exit(EXIT_FAILURE);
+        }
+        eventQueue.events = events;
+        eventQueue.capacity = capacity;
+    }
+
+    // Sift up
+    struct ParticleEvent event = { particleEventTime(seq), particleHandle(seq) };
+    int i = eventQueue.size++;
+    while (i > 0 && eventQueue.events[(i - 1) / 2].time > event.time) {
+        eventQueue.events[i] = eventQueue.events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    eventQueue.events[i] = event;
+}
+
+struct ParticleEvent eventQueuePop() {
+    struct ParticleEvent top = eventQueue.events[0];
+    struct ParticleEvent last = eventQueue.events[--eventQueue.size];
+
+    // Sift down
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= eventQueue.size) {
+            break;
+        }
+        if (child + 1 < eventQueue.size && eventQueue.events[child + 1].time < eventQueue.events[child].time) {
+            child++;
+        }
+        if (eventQueue.events[child].time >= last.time) {
+            break;
+        }
+        eventQueue.events[i] = eventQueue.events[child];
+        i = child;
+    }
+    if (eventQueue.size > 0) {
+        eventQueue.events[i] = last;
+    }
+    return top;
+}
+
+// Take the particle's current state as its launch state at sim time t and
+// queue its next event
+void launchParticle(unsigned int seq, double t) {
+    struct ParticleSchedule* schedule = scheduleAt(seq);
+    schedule->launchAge = (float)(t - schedule->birthTick);
+    schedule->eventAge = schedule->launchAge + predictParticleEvent(particleAt(seq));
+    eventQueuePush(seq);
+}
+
+// Requeue every live particle's pending event, dropping those left behind by
+// particles that died early
+void rebuildEventQueue() {
+    eventQueue.size = 0;
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        if (!isParticleRetired(seq)) {
+            eventQueuePush(seq);
+        }
+    }
+}
+
+// Process every event due by the current sim time. Particles without a due
+// event are not touched.
+void processParticleEvents() {
+    while (eventQueue.size > 0 && eventQueue.events[0].time <= simTime) {
+        struct ParticleEvent event = eventQueuePop();
+        unsigned int seq;
+
+        // Retired early, by expiry or a reset
+        if (!resolveHandle(event.handle, &seq)) {
+            continue;
+        }
+
+        struct Particle* particle = particleAt(seq);
+        int type = particle->eventType;
+        bool alive = true;
+
+        // Up to its event the particle follows its parabola, except while
+        // stepping, which integrates on from the last step
+        if (type == EVENT_STEP) {
+            event.time = particleLaunchTime(seq);
+        }
+        else {
+            *particle = evaluateParticle(particle, (float)(event.time - particleLaunchTime(seq)));
+        }
+
+        switch (type) {
+        case EVENT_GROUND: {
+            struct ParticleState state;
+            unpackParticle(particle, &state);
+            handleGroundCollision(&state);
+            packParticle(particle, &state);
+            if (depositParticle(particle, &state)) {
+                alive = false;
+                break;
+            }
+            alive = state.speed >= 0.1;
+            tickMetrics[METRIC_DEATHS_STOPPED] += !alive;
+            break;
+        }
+        case EVENT_DEATH:
+            tickMetrics[METRIC_DEATHS_FELL]++;
+            alive = false;
+            break;
+        case EVENT_SPHERE:
+        case EVENT_STEP:
+            // Catch up to the current time with the tick integrator
+            alive = updateParticle(particle, (float)(simTime - event.time));
+            event.time = simTime;
+            break;
+        }
+
+        if (alive) {
+            launchParticle(seq, event.time);
+        }
+        else {
+            retireParticle(seq);
+        }
+    }
+}
+
+// Bring a particle behind on its LOD updates up to the current time
+void catchUpParticle(unsigned int seq) {
+    double launchTime = particleLaunchTime(seq);
+    if (simTime > launchTime && !updateParticle(particleAt(seq), (float)(simTime - launchTime))) {
+        retireParticle(seq);
+    }
+}
+
+// Switch between per-tick integration and event-driven analytic trajectories
+void toggleEventDrivenMode() {
+    eventDrivenMode = !eventDrivenMode;
+    eventQueue.size = 0;
+
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        if (isParticleRetired(seq)) {
+            continue;
+        }
+
+        struct ParticleSchedule* schedule = scheduleAt(seq);
+        if (eventDrivenMode) {
+            if (lodMode) {
+                catchUpParticle(seq);
+                if (isParticleRetired(seq)) {
+                    continue;
+                }
+            }
+            launchParticle(seq, simTime);
+        }
+        else {
+            float tau = (float)(simTime - particleLaunchTime(seq));
+            *particleAt(seq) = evaluateParticle(particleAt(seq), tau);
+            schedule->launchAge = schedule->eventAge = (float)(simTime - schedule->birthTick);
+        }
+    }
+}
+
+// Whether the particle is close enough to the ground or a sphere that it
+// must keep the full update rate
+bool isParticleNearCollider(const struct Particle* particle) {
+    for (int i = 0; i < scene->meshCount; i++) {
+        const struct Mesh* mesh = &scene->meshes[i];
+        if (particle->px > mesh->lo[X] - LOD_COLLIDER_MARGIN && particle->px < mesh->hi[X] + LOD_COLLIDER_MARGIN &&
+            particle->py > mesh->lo[Y] - LOD_COLLIDER_MARGIN && particle->py < mesh->hi[Y] + LOD_COLLIDER_MARGIN &&
+            particle->pz > mesh->lo[Z] - LOD_COLLIDER_MARGIN && particle->pz < mesh->hi[Z] + LOD_COLLIDER_MARGIN) {
+            return true;
+        }
+    }
+
+    if (scene->sdf != NULL) {
+        float position[3] = { particle->px, particle->py, particle->pz };
+        float sample[4];
+        sampleDistanceGrid(scene->sdf, position, sample);
+        return sample[0] < LOD_COLLIDER_MARGIN;
+    }
+
+    if (particle->py < GROUND_CONTACT_HEIGHT + LOD_COLLIDER_MARGIN && particle->py > -LOD_COLLIDER_MARGIN &&
+        particle->px >= -scene->groundSize - LOD_COLLIDER_MARGIN && particle->px <= scene->groundSize + LOD_COLLIDER_MARGIN &&
+        particle->pz >= -scene->groundSize - LOD_COLLIDER_MARGIN && particle->pz <= scene->groundSize + LOD_COLLIDER_MARGIN) {
+        return true;
+    }
+
+    float reach = scene->sphereRadius + LOD_COLLIDER_MARGIN;
+    for (int i = 0; i < scene->sphereCount; i++) {
+        if (squaredDistance(particle->px, particle->py, particle->pz,
+            scene->spheres[i].center[X], scene->spheres[i].center[Y], scene->spheres[i].center[Z]) < reach * reach) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Longest update interval, in ticks, whose integration error stays within
+// the error budget once projected to the screen
+int particleUpdateInterval(const struct Particle* particle, const float acceleration[3]) {
+    if (isParticleNearCollider(particle)) {
+        return 1;
+    }
+
+    // Eye space position; the camera looks down -z
+    const GLfloat* m = lodView.matrix;
+    float ex = m[0] * particle->px + m[4] * particle->py + m[8] * particle->pz + m[12];
+    float ey = m[1] * particle->px + m[5] * particle->py + m[9] * particle->pz + m[13];
+    float ez = m[2] * particle->px + m[6] * particle->py + m[10] * particle->pz + m[14];
+    float depth = fmaxf(-ez, 0.1);
+
+    // Frustum of gluPerspective(45.0, 1.0, ...), tan(22.5 degrees)
+    float extent = depth * 0.4142;
+    bool visible = -ez > 0.1 && fabsf(ex) <= extent && fabsf(ey) <= extent;
+    float budget = lodErrorBudget * (visible ? 1.0 : LOD_OFFSCREEN_FACTOR);
+
+    // One step of n ticks lands k * a * n * (n - 1) / 2 away from n single
+    // steps, a being gravity plus the force fields
+    float k = particle->speed / SPEED_SCALE * scene->speedFactor;
+    float a = sqrtf(acceleration[X] * acceleration[X] + acceleration[Z] * acceleration[Z] +
+        (scene->gravity + acceleration[Y]) * (scene->gravity + acceleration[Y]));
+    int interval = 1;
+    while (interval < MAX_LOD_TICKS) {
+        int n = interval * 2;
+        float error = 0.5 * k * a * n * (n - 1);
+        if (error * lodView.pixelsPerUnit / depth > budget) {
+            break;
+        }
+        interval = n;
+    }
+    return interval;
+}
+
+// Whether the particle's LOD interval is up
+bool isParticleDue(unsigned int seq) {
+    struct ParticleSchedule* schedule = scheduleAt(seq);
+    return simTime - schedule->birthTick >= schedule->eventAge;
+}
+
+// Update a particle whose LOD interval is up by the whole interval at once.
+// Returns false once the particle has died.
+bool updateParticleLod(unsigned int seq, const float acceleration[3]) {
+    struct ParticleSchedule* schedule = scheduleAt(seq);
+    float age = (float)(simTime - schedule->birthTick);
+
+    struct Particle* particle = particleAt(seq);
+    bool alive = integrateParticle(particle, age - schedule->launchAge, acceleration);
+    schedule->launchAge = age;
+    schedule->eventAge = age + particleUpdateInterval(particle, acceleration);
+    return alive;
+}
+
+// Switch reduced update rates for distant and off-screen particles
+void toggleLodMode() {
+    lodMode = !lodMode;
+
+    // Event-driven particles keep their own schedule
+    if (eventDrivenMode) {
+        return;
+    }
+
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        if (isParticleRetired(seq)) {
+            continue;
+        }
+
+        // Particles are only behind on their updates when leaving LOD mode
+        if (!lodMode) {
+            catchUpParticle(seq);
+        }
+        struct ParticleSchedule* schedule = scheduleAt(seq);
+        schedule->launchAge = schedule->eventAge = (float)(simTime - schedule->birthTick);
+    }
+}
+
+// Move the live particles of the ring up against the head, dropping the
+// tombstones between them. Moved particles get new sequence numbers.
+void compactParticles() {
+    unsigned int write = particleList.head;
+
+    for (unsigned int read = particleList.head; read != particleList.tail; ) {
+        read--;
+        if (isParticleRetired(read)) {
+            continue;
+        }
+        write--;
+        if (write != read) {
+            moveHandle(read, write);
+            *particleAt(write) = *particleAt(read);
+            *scheduleAt(write) = *scheduleAt(read);
+            particleList.history[write & (particleList.capacity - 1)] =
+                particleList.history[read & (particleList.capacity - 1)];
+        }
+    }
+
+    memset(particleList.tombstones, 0, particleList.capacity / 32 * sizeof(unsigned int));
+    particleList.tail = write;
+}
+
+// Spread the low 10 bits of v out to every third bit
+unsigned int mortonSpread(unsigned int v) {
+    v &= 0x3FF;
+    v = (v | (v << 16)) & 0x030000FF;
+    v = (v | (v << 8)) & 0x0300F00F;
+    v = (v | (v << 4)) & 0x030C30C3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// Z-order code of the particle's position, 10 bits per axis
+unsigned int mortonCode(const struct Particle* particle) {
+    float position[3] = { particle->px, particle->py, particle->pz };
+    unsigned int cell[3];
+    for (int i = 0; i < 3; i++) {
+        float t = (position[i] + MORTON_EXTENT) * (1024.0 / (2.0 * MORTON_EXTENT));
+        cell[i] = (unsigned int)fmaxf(fminf(t, 1023.0), 0.0);
+    }
+    return mortonSpread(cell[X]) | (mortonSpread(cell[Y]) << 1) | (mortonSpread(cell[Z]) << 2);
+}
+
+// Reorder the live particles in [first, last) by Morton code with an LSD
+// radix sort, packing them to the front of the range and the tombstones
+// behind them
+void sortParticleRange(unsigned int first, unsigned int last) {
+    struct ParticleSort* sort = &particleSort;
+    unsigned int rangeSize = last - first;
+    int count = 0;
+
+    for (unsigned int offset = 0; offset < rangeSize; offset++) {
+        unsigned int seq = first + offset;
+        sort->particles[offset] = *particleAt(seq);
+        sort->schedules[offset] = *scheduleAt(seq);
+        sort->history[offset] = particleList.history[seq & (particleList.capacity - 1)];
+        if (!isParticleRetired(seq)) {
+            sort->keys[0][count] = mortonCode(particleAt(seq));
+            sort->order[0][count] = (unsigned short)offset;
+            count++;
+        }
+    }
+
+    // Four passes of 8 bits; each pass is stable, so the result is sorted
+    int from = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int offsets[257] = { 0 };
+        for (int i = 0; i < count; i++) {
+            offsets[((sort->keys[from][i] >> shift) & 0xFF) + 1]++;
+        }
+        for (int digit = 0; digit < 256; digit++) {
+            offsets[digit + 1] += offsets[digit];
+        }
+        for (int i = 0; i < count; i++) {
+            int j = offsets[(sort->keys[from][i] >> shift) & 0xFF]++;
+            sort->keys[!from][j] = sort->keys[from][i];
+            sort->order[!from][j] = sort->order[from][i];
+        }
+        from = !from;
+    }
+
+    for (int i = 0; i < count; i++) {
+        unsigned int offset = sort->order[from][i];
+        unsigned int seq = first + i;
+        *particleAt(seq) = sort->particles[offset];
+        *scheduleAt(seq) = sort->schedules[offset];
+        particleList.history[seq & (particleList.capacity - 1)] = sort->history[offset];
+        handleTable.entries[sort->schedules[offset].handle].seq = seq;
+    }
+    for (unsigned int offset = 0; offset < rangeSize; offset++) {
+        unsigned int slot = (first + offset) & (particleList.capacity - 1);
+        if (offset < (unsigned int)count) {
+            particleList.tombstones[slot / 32] &= ~(1u << (slot % 32));
+        }
+        else {
+            particleList.tombstones[slot / 32] |= 1u << (slot % 32);
+        }
+    }
+}
+
+// Re-sort the next full chunk of the ring, starting over from the tail once
+// the cursor reaches the chunk still being filled at the head
+void sortNextParticleChunk() {
+    unsigned int tailChunk = particleList.tail & ~(SORT_CHUNK_SIZE - 1u);
+    unsigned int first = particleSort.cursor;
+
+    if (first - tailChunk > particleList.head - tailChunk ||
+        particleList.head - first < SORT_CHUNK_SIZE) {
+        first = tailChunk;
+    }
+    if (particleList.head - first < SORT_CHUNK_SIZE) {
+        return;
+    }
+
+    particleSort.cursor = first + SORT_CHUNK_SIZE;
+    if (first - particleList.tail > particleList.head - particleList.tail) {
+        first = particleList.tail;
+    }
+    sortParticleRange(first, particleSort.cursor);
+}
+
+// Retire particles past their lifetime and advance the tail past retired
+// slots. Particles are born in ring order, except for the Morton re-sort
+// shuffling them within a chunk, so expired ones sit in the oldest two chunks.
+void removeInactiveParticles() {
+    if (maxLifetime > 0.0) {
+        unsigned int end = (particleList.tail & ~(SORT_CHUNK_SIZE - 1u)) + 2 * SORT_CHUNK_SIZE;
+        if (end - particleList.tail > particleList.head - particleList.tail) {
+            end = particleList.head;
+        }
+        for (unsigned int seq = particleList.tail; seq != end; seq++) {
+            if (!isParticleRetired(seq) && simTime - scheduleAt(seq)->birthTick >= maxLifetime) {
+                retireParticle(seq);
+                tickMetrics[METRIC_DEATHS_EXPIRED]++;
+            }
+        }
+    }
+
+    while (particleList.tail != particleList.head) {
+        unsigned int seq = particleList.tail;
+
+        if (!isParticleRetired(seq)) {
+            break;
+        }
+
+        unsigned int slot = seq & (particleList.capacity - 1);
+        particleList.tombstones[slot / 32] &= ~(1u << (slot % 32));
+        particleList.tail++;
+    }
+
+    // Out of order deaths are only cleared out once they pile up
+    unsigned int tombstoneCount = particleList.head - particleList.tail - particleList.size;
+    if (tombstoneCount > COMPACTION_MIN_TOMBSTONES && tombstoneCount > (unsigned int)particleList.size) {
+        compactParticles();
+    }
+
+    // Likewise for the events of expired particles
+    int staleEvents = eventQueue.size - particleList.size;
+    if (eventDrivenMode && staleEvents > COMPACTION_MIN_TOMBSTONES && staleEvents > particleList.size) {
+        rebuildEventQueue();
+    }
+}
+
+// Create a particle from the emitter that has already been flying for age ticks
+void emitParticle(int emitter, int age) {
+    unsigned int seq = particleList.head;
+
+    createParticle(emitter);
+    scheduleAt(seq)->birthTick = (unsigned int)(simTime - age);
+    if (eventDrivenMode) {
+        launchParticle(seq, simTime - age);
+    }
+    else {
+        struct ParticleSchedule* schedule = scheduleAt(seq);
+        schedule->launchAge = schedule->eventAge = age;
+        if (age > 0 && !updateParticle(particleAt(seq), age)) {
+            retireParticle(seq);
+        }
+    }
+}
+
+// Interpolate between two binary angles the short way round, in degrees
+float lerpAngle(unsigned short from, unsigned short to, float alpha) {
+    short delta = (short)(to - from);
+    return (from + delta * alpha) * 360.0 / ANGLE_UNITS;
+}
+
+// Render the particle, alpha of the way from its previous to its current state
+void renderParticle(const struct RenderParticle* particle, float alpha) {
+    glPushMatrix();
+    glTranslatef(lerp(particle->prevPosition[X], particle->position[X], alpha),
+        lerp(particle->prevPosition[Y], particle->position[Y], alpha),
+        lerp(particle->prevPosition[Z], particle->position[Z], alpha));
+    glRotatef(lerpAngle(particle->prevAngle[X], particle->angle[X], alpha), 1.0, 0.0, 0.0);
+    glRotatef(lerpAngle(particle->prevAngle[Y], particle->angle[Y], alpha), 0.0, 1.0, 0.0);
+    glRotatef(lerpAngle(particle->prevAngle[Z], particle->angle[Z], alpha), 0.0, 0.0, 1.0);
+
+    int mode = qualityLevels[governor.level].pointParticles ? 1 : currentRenderMode;
+    GLubyte opacity = mode == 4 ? PARTICLE_OPACITY : 255;
+    GLfloat mat_ambient_diffuse[] = { particle->color[0] / 255.0,
+        particle->color[1] / 255.0, particle->color[2] / 255.0, opacity / 255.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { 60.0 };
+
+    glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE, mat_ambient_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    glColor4ub(particle->color[0], particle->color[1], particle->color[2], opacity);
+
+    switch (mode) {
+    // points mode
+    case 1:
+        glBegin(GL_POINTS);
+        glVertex3f(0.0, 0.0, 0.0);
+        glEnd();
+        break;
+    // wireframe mode
+    case 2:
+        glBegin(GL_LINES);
+        // Front face
+        glVertex3f(-0.1, -0.1, 0.1);
+        glVertex3f(0.1, -0.1, 0.1);
+        glVertex3f(0.1, -0.1, 0.1);
+        glVertex3f(0.1, 0.1, 0.1);
+        glVertex3f(0.1, 0.1, 0.1);
+        glVertex3f(-0.1, 0.1, 0.1);
+        glVertex3f(-0.1, 0.1, 0.1);
+        glVertex3f(-0.1, -0.1, 0.1);
+        // Back face
+        glVertex3f(-0.1, -0.1, -0.1);
+        glVertex3f(0.1, -0.1, -0.1);
+        glVertex3f(0.1, -0.1, -0.1);
+        glVertex3f(0.1, 0.1, -0.1);
+        glVertex3f(0.1, 0.1, -0.1);
+        glVertex3f(-0.1, 0.1, -0.1);
+        glVertex3f(-0.1, 0.1, -0.1);
+        glVertex3f(-0.1, -0.1, -0.1);
+        // Connecting lines
+        glVertex3f(-0.1, -0.1, 0.1);
+        glVertex3f(-0.1, -0.1, -0.1);
+        glVertex3f(0.1, -0.1, 0.1);
+        glVertex3f(0.1, -0.1, -0.1);
+        glVertex3f(0.1, 0.1, 0.1);
+        glVertex3f(0.1, 0.1, -0.1);
+        glVertex3f(-0.1, 0.1, 0.1);
+        glVertex3f(-0.1, 0.1, -0.1);
+        glEnd();
+        break;
+    // solid and translucent modes
+    case 4:
+    case 3:
+        // Front face
+        glBegin(GL_POLYGON);
+        //glNormal3f(0.0, 0.0, 1.0); // Normal for the front face
+        glNormal3f(-0.5774, -0.5774, 0.5774);
+        glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Bottom left)
+        glNormal3f(0.5774, -0.5774, 0.5774);
+        glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Bottom right)
+        glNormal3f(0.5774, 0.5774, 0.5774);
+        glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Top right)
+        glNormal3f(-0.5774, 0.5774, 0.5774);
+        glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Top left)
+        glEnd();
+
+        // Back face
+        glBegin(GL_POLYGON);
+        //glNormal3f(0.0, 0.0, -1.0); // Normal for the back face
+        glNormal3f(0.5774, 0.5774, -0.5774);
+        glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Top right)
+        glNormal3f(0.5774, -0.5774, -0.5774);
+        glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Bottom right)
+        glNormal3f(-0.5774, -0.5774, -0.5774);
+        glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Bottom left)
+        glNormal3f(-0.5774, 0.5774, -0.5774);
+        glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Top left)
+        glEnd();
+
+        // Right face
+        glBegin(GL_POLYGON);
+        //glNormal3f(1.0, 0.0, 0.0); // Normal for the right face
+        glNormal3f(0.5774, -0.5774, 0.5774);
+        glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Bottom front)
+        glNormal3f(0.5774, -0.5774, -0.5774);
+        glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Bottom back)
+        glNormal3f(0.5774, 0.5774, -0.5774);
+        glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Top back)
+        glNormal3f(0.5774, 0.5774, 0.5774);
+        glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Top front)
+        glEnd();
+
+        // Left face
+        glBegin(GL_POLYGON);
+        //glNormal3f(-1.0, 0.0, 0.0); // Normal for the left face
+        glNormal3f(-0.5774, 0.5774, 0.5774);
+        glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Top front)
+        glNormal3f(-0.5774, 0.5774, -0.5774);
+        glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Top back)
+        glNormal3f(-0.5774, -0.5774, -0.5774);
+        glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Bottom back)
+        glNormal3f(-0.5774, -0.5774, 0.5774);
+        glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Bottom front)
+        glEnd();
+
+        // Top face
+        glBegin(GL_POLYGON);
+        //glNormal3f(0.0, 1.0, 0.0); // Normal for the top face
+        glNormal3f(-0.5774, 0.5774, 0.5774);
+        glVertex3f(-0.1, 0.1, 0.1);   // Vertex 4 (Front left)
+        glNormal3f(0.5774, 0.5774, 0.5774);
+        glVertex3f(0.1, 0.1, 0.1);    // Vertex 3 (Front right)
+        glNormal3f(0.5774, 0.5774, -0.5774);
+        glVertex3f(0.1, 0.1, -0.1);   // Vertex 5 (Back right)
+        glNormal3f(-0.5774, 0.5774, -0.5774);
+        glVertex3f(-0.1, 0.1, -0.1);  // Vertex 8 (Back left)
+        glEnd();
+
+        // Bottom face
+        glBegin(GL_POLYGON);
+        //glNormal3f(0.0, -1.0, 0.0); // Normal for the bottom face
+        glNormal3f(-0.5774, -0.5774, -0.5774);
+        glVertex3f(-0.1, -0.1, -0.1); // Vertex 7 (Back left)
+        glNormal3f(0.5774, -0.5774, -0.5774);
+        glVertex3f(0.1, -0.1, -0.1);  // Vertex 6 (Back right)
+        glNormal3f(0.5774, -0.5774, 0.5774);
+        glVertex3f(0.1, -0.1, 0.1);   // Vertex 2 (Front right)
+        glNormal3f(-0.5774, -0.5774, 0.5774);
+        glVertex3f(-0.1, -0.1, 0.1);  // Vertex 1 (Front left)
+        glEnd();
+        break;
+    }
+
+    glPopMatrix();
+}
+
+// Monotonic clock in milliseconds, so clock steps never skew frame costs
+double currentTimeMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+// Add to a counter of the calling thread
+void addThreadMetric(int thread, int metric, unsigned long long amount) {
+    atomic_ullong* counter = &threadMetrics[thread].counters[metric];
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+        memory_order_relaxed);
+}
+
+// Move the simulation thread's counts for the tick into its shared counters
+void flushTickMetrics() {
+    for (int metric = 0; metric < METRIC_COUNT; metric++) {
+        if (tickMetrics[metric] != 0) {
+            addThreadMetric(METRIC_THREAD_SIMULATION, metric, tickMetrics[metric]);
+            tickMetrics[metric] = 0;
+        }
+    }
+    atomic_store_explicit(&particleGauge, particleList.size, memory_order_relaxed);
+}
+
+// Record the cost of a frame and, once per interval, step the quality
+// level down when over budget or back up when there is headroom. With
+// simulation and rendering overlapped, the slower of the two sets the cost.
+void governFrame(double renderMs, double simMs) {
+    governor.totalMs += fmax(renderMs, simMs);
+    if (++governor.frames < GOVERNOR_INTERVAL) {
+        return;
+    }
+
+    governor.averageMs = governor.totalMs / governor.frames;
+    governor.totalMs = 0.0;
+    governor.frames = 0;
+    if (!governor.enabled) {
+        return;
+    }
+
+    int level = governor.level;
+    if (governor.averageMs > governor.budgetMs && level < QUALITY_LEVEL_COUNT - 1) {
+        level++;
+    }
+    else if (governor.averageMs < governor.budgetMs * GOVERNOR_HEADROOM && level > 0) {
+        level--;
+    }
+
+    if (level != governor.level) {
+        printf("Governor: frame cost %.2f ms against %.1f ms budget, quality %d -> %d "
+            "(emission %.0f%%, sphere slices %d, %s particles)\n",
+            governor.averageMs, governor.budgetMs, governor.level, level,
+            qualityLevels[level].emission * 100.0, qualityLevels[level].sphereSlices,
+            qualityLevels[level].pointParticles ? "point" : "full");
+        governor.level = level;
+    }
+}
+
+void toggleGovernor() {
+    governor.enabled = !governor.enabled;
+    if (!governor.enabled) {
+        governor.level = 0;
+    }
+}
+
+// Step every live particle due for an update by dt ticks, or its LOD
+// interval. Particles are taken a block at a time: their positions are
+// gathered, each force field makes one pass over the block, and the block
+// is then integrated with the summed accelerations.
+void updateParticles(float dt) {
+    struct FieldBlock block;
+    bool sample = scene->fieldCount > 0;
+    unsigned int seq = particleList.tail;
+
+    while (seq != particleList.head) {
+        block.count = 0;
+        for (; seq != particleList.head && block.count < FIELD_BLOCK_SIZE; seq++) {
+            if (isParticleRetired(seq) || (lodMode && !isParticleDue(seq))) {
+                continue;
+            }
+            const struct Particle* particle = particleAt(seq);
+            block.seq[block.count] = seq;
+            block.position[X][block.count] = particle->px;
+            block.position[Y][block.count] = particle->py;
+            block.position[Z][block.count] = particle->pz;
+            block.count++;
+        }
+
+        if (sample) {
+            sampleForceFields(&block);
+        }
+        for (int i = 0; i < block.count; i++) {
+            float acceleration[3] = { 0.0, 0.0, 0.0 };
+            if (sample) {
+                acceleration[X] = block.acceleration[X][i];
+                acceleration[Y] = block.acceleration[Y][i];
+                acceleration[Z] = block.acceleration[Z][i];
+            }
+
+            unsigned int current = block.seq[i];
+            bool alive = lodMode ? updateParticleLod(current, acceleration) :
+                integrateParticle(particleAt(current), dt, acceleration);
+            if (!alive) {
+                retireParticle(current);
+            }
+        }
+    }
+}
+
+// Update the entire frame by dt timer ticks
+void updateFrame(float dt) {
+    simTime += dt;
+
+    if (eventDrivenMode) {
+        processParticleEvents();
+    }
+    else {
+        updateParticles(dt);
+    }
+
+    removeInactiveParticles();
+
+    particleSort.ticks += dt;
+    if (sortInterval > 0 && particleSort.ticks >= sortInterval) {
+        particleSort.ticks = 0.0;
+        sortNextParticleChunk();
+    }
+}
+
+void tripleBufferPublish(struct TripleBuffer* buffer) {
+    buffer->back = atomic_exchange(&buffer->middle, buffer->back | TRIPLE_BUFFER_FRESH) & 3;
+}
+
+// Take the most recently published slot as the front slot, if there is a
+// new one
+bool tripleBufferAcquire(struct TripleBuffer* buffer) {
+    if (!(atomic_load(&buffer->middle) & TRIPLE_BUFFER_FRESH)) {
+        return false;
+    }
+    buffer->front = atomic_exchange(&buffer->middle, buffer->front) & 3;
+    return true;
+}
+
+// Remove the shared-memory object, if this process created it
+void unlinkSharedExport() {
+    if (sharedExport.fd >= 0) {
+        shm_unlink(SHARED_MEMORY_NAME);
+        close(sharedExport.fd);
+        sharedExport.fd = -1;
+    }
+}
+
+// Create the shared-memory object and lock it for as long as this process
+// owns it. An object left behind by an instance that has gone is replaced;
+// one whose lock is held belongs to a running instance and is left alone,
+// failing with EEXIST.
+int createSharedObject() {
+    int fd = shm_open(SHARED_MEMORY_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd < 0 && errno == EEXIST) {
+        int existing = shm_open(SHARED_MEMORY_NAME, O_RDWR, 0);
+        bool live = existing < 0 || flock(existing, LOCK_EX | LOCK_NB) != 0;
+        if (!live) {
+            shm_unlink(SHARED_MEMORY_NAME);
+        }
+        if (existing >= 0) {
+            close(existing);
+        }
+        if (live) {
+            errno = EEXIST;
+            return -1;
+        }
+        fd = shm_open(SHARED_MEMORY_NAME, O_CREAT | O_EXCL | O_RDWR, 0644);
+    }
+    if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        errno = EEXIST;
+        return -1;
+    }
+    return fd;
+}
+
+// Create the shared-memory export. Returns false if it could not be mapped
+// or another running instance is exporting.
+bool openSharedExport() {
+    static bool unlinkAtExit = false;
+    size_t headerSize = (sizeof(struct SharedFrameHeader) + 63) & ~(size_t)63;
+    size_t arraySize = SHARED_MAX_PARTICLES * sizeof(float);
+    size_t size = headerSize + 4 * arraySize;
+
+    sharedExport.fd = createSharedObject();
+    if (sharedExport.fd < 0) {
+        if (errno == EEXIST) {
+            fprintf(stderr, "Error: The shared-memory export %s belongs to another running instance.\n",
+                SHARED_MEMORY_NAME);
+        }
+        else {
+            fprintf(stderr, "Error: Could not create the shared-memory export: %s.\n", strerror(errno));
+        }
+        return false;
+    }
+    void* base = MAP_FAILED;
+    if (ftruncate(sharedExport.fd, size) == 0) {
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sharedExport.fd, 0);
+    }
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map the shared-memory export.\n");
+        unlinkSharedExport();
+        return false;
+    }
+
+    struct SharedFrameHeader* header = (struct SharedFrameHeader*)base;
+    header->capacity = SHARED_MAX_PARTICLES;
+    header->count = 0;
+    header->simTime = simTime;
+    header->xOffset = headerSize;
+    header->yOffset = headerSize + arraySize;
+    header->zOffset = headerSize + 2 * arraySize;
+    header->colorOffset = headerSize + 3 * arraySize;
+    atomic_store(&header->sequence, 0);
+    header->magic = SHARED_MAGIC;
+
+    sharedExport.header = header;
+    sharedExport.size = size;
+    if (!unlinkAtExit) {
+        atexit(unlinkSharedExport);
+        unlinkAtExit = true;
+    }
+    return true;
+}
+
+void closeSharedExport() {
+    munmap(sharedExport.header, sharedExport.size);
+    sharedExport.header = NULL;
+    unlinkSharedExport();
+}
+
+// Write the frame into the shared-memory export. Readers never hold the
+// writer up; they retry instead.
+void writeSharedFrame(const struct RenderFrame* frame) {
+    struct SharedFrameHeader* header = sharedExport.header;
+    char* base = (char*)header;
+    float* x = (float*)(base + header->xOffset);
+    float* y = (float*)(base + header->yOffset);
+    float* z = (float*)(base + header->zOffset);
+    unsigned int* color = (unsigned int*)(base + header->colorOffset);
+    unsigned int sequence = atomic_load_explicit(&header->sequence, memory_order_relaxed);
+
+    atomic_store_explicit(&header->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    int count = frame->count < SHARED_MAX_PARTICLES ? frame->count : SHARED_MAX_PARTICLES;
+    for (int i = 0; i < count; i++) {
+        const struct RenderParticle* particle = &frame->particles[i];
+        x[i] = particle->position[X];
+        y[i] = particle->position[Y];
+        z[i] = particle->position[Z];
+        color[i] = particle->color[0] | (particle->color[1] << 8) | (particle->color[2] << 16) | 0xFF000000u;
+    }
+    header->count = count;
+    header->simTime = simTime;
+
+    atomic_store_explicit(&header->sequence, sequence + 2, memory_order_release);
+}
+
+void toggleExportMode() {
+    if (sharedExport.header != NULL) {
+        closeSharedExport();
+    }
+    else {
+        openSharedExport();
+    }
+    exportMode = sharedExport.header != NULL;
+}
+
+// Give the trail pool a ring for every handle table entry. Rings of new
+// entries start empty.
+void growTrailPool() {
+    unsigned int capacity = handleTable.capacity;
+    int length = trailLength;
+    float (*points)[3] = (float(*)[3])realloc(trailPool.points, (size_t)capacity * length * sizeof(*points));
+    unsigned char* count = (unsigned char*)realloc(trailPool.count, capacity);
+    unsigned char* next = (unsigned char*)realloc(trailPool.next, capacity);
+    if (points == NULL || count == NULL || next == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for the trail pool.\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(count + trailPool.capacity, 0, capacity - trailPool.capacity);
+    memset(next + trailPool.capacity, 0, capacity - trailPool.capacity);
+    trailPool.points = points;
+    trailPool.count = count;
+    trailPool.next = next;
+    trailPool.capacity = capacity;
+}
+
+// Switch to the next trail length: none, then 8, 16, 32 and 64 points. The
+// pool is dropped and regrown at the new length, so every trail restarts.
+void cycleTrailLength() {
+    int length = trailLength;
+    trailLength = length >= MAX_TRAIL_LENGTH ? 0 : length <= 0 ? 8 : length * 2;
+    free(trailPool.points);
+    free(trailPool.count);
+    free(trailPool.next);
+    trailPool = (struct TrailPool){ NULL, NULL, NULL, 0 };
+}
+
+// Add the particle's position to the trail of its handle and copy the trail
+// into the frame as the particle's block of points, oldest first, fading in
+// from the tail. A trail short of the full length is padded at its tail with
+// copies of its oldest point, drawing nothing.
+void recordTrail(struct RenderFrame* frame, unsigned int handle, const struct RenderParticle* particle) {
+    if (handle >= trailPool.capacity) {
+        growTrailPool();
+    }
+
+    int length = trailLength;
+    float (*ring)[3] = &trailPool.points[(size_t)handle * length];
+    memcpy(ring[trailPool.next[handle]], particle->position, sizeof(ring[0]));
+    trailPool.next[handle] = (trailPool.next[handle] + 1) % length;
+    if (trailPool.count[handle] < length) {
+        trailPool.count[handle]++;
+    }
+
+    int count = trailPool.count[handle];
+    int oldest = (trailPool.next[handle] + length - count) % length;
+    float (*points)[3] = &frame->trailPoints[(size_t)(frame->count - 1) * length];
+    unsigned char (*colors)[4] = &frame->trailColors[(size_t)(frame->count - 1) * length];
+    for (int i = 0; i < length; i++) {
+        int point = i - (length - count);
+        memcpy(points[i], ring[(oldest + (point > 0 ? point : 0)) % length], sizeof(points[i]));
+        memcpy(colors[i], particle->color, 3);
+        colors[i][3] = point >= 0 ? (unsigned char)(255 * (point + 1) / count) : 0;
+    }
+}
+
+// Copy the particles' current state into the back render frame and hand it
+// to the renderer
+void publishRenderFrame(float simMs, float stepMs) {
+    struct RenderFrame* frame = &renderFrames[renderBuffer.back];
+
+    if (frame->capacity < particleList.size) {
+        frame->capacity = particleList.size * 2;
+        free(frame->particles);
+        frame->particles = (struct RenderParticle*)malloc(frame->capacity * sizeof(struct RenderParticle));
+        if (frame->particles == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for a render frame.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Trails grow with the particles, a block of points per particle
+    int trailPoints = trailLength;
+    if (trailPoints > 0 && (frame->trailCapacity < frame->capacity || frame->trailStride != trailPoints)) {
+        frame->trailCapacity = frame->capacity;
+        free(frame->trailPoints);
+        free(frame->trailColors);
+        size_t points = (size_t)frame->trailCapacity * trailPoints;
+        frame->trailPoints = (float(*)[3])malloc(points * sizeof(*frame->trailPoints));
+        frame->trailColors = (unsigned char(*)[4])malloc(points * sizeof(*frame->trailColors));
+        if (frame->trailPoints == NULL || frame->trailColors == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for a render frame.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    frame->trailStride = trailPoints;
+
+    // Event-driven and LOD particles are only brought up to date here
+    bool evaluate = eventDrivenMode || lodMode;
+    unsigned int selected = 0;
+    frame->hasSelected = resolveHandle(selectedParticle, &selected);
+    frame->count = 0;
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        if (isParticleRetired(seq)) {
+            continue;
+        }
+
+        struct Particle particle = *particleAt(seq);
+        if (evaluate) {
+            particle = evaluateParticle(&particle, (float)(simTime - particleLaunchTime(seq)));
+        }
+
+        struct RenderParticle* out = &frame->particles[frame->count++];
+        struct ParticleHistory* history = &particleList.history[seq & (particleList.capacity - 1)];
+        out->position[X] = particle.px;
+        out->position[Y] = particle.py;
+        out->position[Z] = particle.pz;
+        memcpy(out->angle, particle.angle, sizeof(out->angle));
+        memcpy(out->prevPosition, history->position, sizeof(out->prevPosition));
+        memcpy(out->prevAngle, history->angle, sizeof(out->prevAngle));
+        memcpy(out->color, particle.color, sizeof(out->color));
+        memcpy(history->position, out->position, sizeof(history->position));
+        memcpy(history->angle, out->angle, sizeof(history->angle));
+        if (trailPoints > 0) {
+            recordTrail(frame, scheduleAt(seq)->handle, out);
+        }
+
+        if (frame->hasSelected && seq == selected) {
+            memcpy(frame->selected, out->position, sizeof(frame->selected));
+            memcpy(frame->prevSelected, out->prevPosition, sizeof(frame->prevSelected));
+        }
+    }
+
+    // The deposit is only copied into frames behind on it, with its colour
+    // totals turned into averages. Bare ground keeps the ground's grey.
+    if (frame->depositVersion != deposit.version) {
+        for (int i = 0; i < DEPOSIT_RESOLUTION * DEPOSIT_RESOLUTION; i++) {
+            float height = deposit.height[i];
+            frame->depositHeight[i] = height;
+            for (int c = 0; c < 3; c++) {
+                frame->depositColor[i][c] = height > 0.0 ? (unsigned char)lrintf(deposit.color[i][c] / height) : 128;
+            }
+        }
+        frame->depositVersion = deposit.version;
+    }
+
+    frame->simMs = simMs;
+    frame->stepMs = stepMs;
+    frame->publishMs = currentTimeMs();
+    if (sharedExport.header != NULL) {
+        writeSharedFrame(frame);
+    }
+    tripleBufferPublish(&renderBuffer);
+}
+
+void lookFromCamera(const struct Scene* current) {
+    gluLookAt(current->eye[X], current->eye[Y], current->eye[Z],
+        current->target[X], current->target[Y], current->target[Z], 0.0, 1.0, 0.0);
+}
+
+// Grid lines of the ground mesh along one axis: the heightfield's, with the
+// hole's edges inserted where they fall on the ground. Each line keeps the
+// heightfield vertex at or before it and how far it is on to the next one.
+// Returns the number of lines.
+int layOutGroundLines(float position[], int vertex[], float fraction[], float groundSize, float holeLo, float holeHi) {
+    float cell = 2.0 * groundSize / (DEPOSIT_RESOLUTION - 1);
+    float edges[2] = { holeLo, holeHi };
+    int edge = 0;
+    int count = 0;
+    for (int i = 0; i < DEPOSIT_RESOLUTION; i++) {
+        float line = i * cell - groundSize;
+        for (; edge < 2 && edges[edge] < line; edge++) {
+            if (edges[edge] > -groundSize) {
+                position[count] = edges[edge];
+                vertex[count] = i - 1;
+                fraction[count] = (edges[edge] - (line - cell)) / cell;
+                count++;
+            }
+        }
+        position[count] = line;
+        vertex[count] = i;
+        fraction[count] = 0.0;
+        count++;
+    }
+    return count;
+}
+
+// Lay out the ground mesh from a frame's heightfield. Vertices on the
+// inserted lines are interpolated from the heightfield around them, and
+// normals come from the height differences either side of each vertex.
+void buildGroundMesh(struct GroundMesh* mesh, const struct RenderFrame* frame, const struct Scene* current) {
+    float g = current->groundSize;
+    const float* hole = current->hole;
+    float x[GROUND_MESH_LINES], z[GROUND_MESH_LINES];
+    int xVertex[GROUND_MESH_LINES], zVertex[GROUND_MESH_LINES];
+    float xFraction[GROUND_MESH_LINES], zFraction[GROUND_MESH_LINES];
+    int columns = layOutGroundLines(x, xVertex, xFraction, g, hole[0], hole[2]);
+    int rows = layOutGroundLines(z, zVertex, zFraction, g, hole[1], hole[3]);
+
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < columns; i++) {
+            int index = j * columns + i;
+            float height = 0.0;
+            float color[3] = { 0.0, 0.0, 0.0 };
+            for (int k = 0; k < 4; k++) {
+                float weight = ((k & 1) ? xFraction[i] : 1.0 - xFraction[i]) *
+                    ((k >> 1) ? zFraction[j] : 1.0 - zFraction[j]);
+                if (weight == 0.0) {
+                    continue;
+                }
+                int source = (zVertex[j] + (k >> 1)) * DEPOSIT_RESOLUTION + xVertex[i] + (k & 1);
+                height += weight * frame->depositHeight[source];
+                for (int c = 0; c < 3; c++) {
+                    color[c] += weight * frame->depositColor[source][c];
+                }
+            }
+            mesh->vertices[index][X] = x[i];
+            mesh->vertices[index][Y] = height;
+            mesh->vertices[index][Z] = z[j];
+            for (int c = 0; c < 3; c++) {
+                mesh->colors[index][c] = (GLubyte)lrintf(color[c]);
+            }
+        }
+    }
+
+    for (int j = 0; j < rows; j++) {
+        for (int i = 0; i < columns; i++) {
+            int index = j * columns + i;
+            int left = i > 0 ? index - 1 : index;
+            int right = i < columns - 1 ? index + 1 : index;
+            int back = j > 0 ? index - columns : index;
+            int front = j < rows - 1 ? index + columns : index;
+            float nx = (mesh->vertices[left][Y] - mesh->vertices[right][Y]) /
+                (mesh->vertices[right][X] - mesh->vertices[left][X]);
+            float nz = (mesh->vertices[back][Y] - mesh->vertices[front][Y]) /
+                (mesh->vertices[front][Z] - mesh->vertices[back][Z]);
+            float length = sqrtf(nx * nx + 1.0 + nz * nz);
+            mesh->normals[index][X] = nx / length;
+            mesh->normals[index][Y] = 1.0 / length;
+            mesh->normals[index][Z] = nz / length;
+        }
+    }
+
+    // Cells in the hole are left out, wound counter-clockwise seen from above
+    mesh->indexCount = 0;
+    for (int j = 0; j < rows - 1; j++) {
+        for (int i = 0; i < columns - 1; i++) {
+            float cx = (x[i] + x[i + 1]) / 2.0;
+            float cz = (z[j] + z[j + 1]) / 2.0;
+            if (cx > hole[0] && cx < hole[2] && cz > hole[1] && cz < hole[3]) {
+                continue;
+            }
+            GLuint a = j * columns + i;
+            GLuint b = a + 1;
+            GLuint c = a + columns;
+            GLuint d = c + 1;
+            GLuint* out = &mesh->indices[mesh->indexCount];
+            out[0] = a;
+            out[1] = c;
+            out[2] = b;
+            out[3] = b;
+            out[4] = c;
+            out[5] = d;
+            mesh->indexCount += 6;
+        }
+    }
+    mesh->version = frame->depositVersion;
+    mesh->groundSize = g;
+    memcpy(mesh->hole, hole, sizeof(mesh->hole));
+}
+
+// Render the ground around the hole, with the deposit on it, as one
+// displaced mesh, whatever the number of particles merged into it
+void renderGround(const struct RenderFrame* frame) {
+    const struct Scene* current = scene;
+    struct GroundMesh* mesh = &groundMesh;
+    if (mesh->version != frame->depositVersion || mesh->groundSize != current->groundSize ||
+        memcmp(mesh->hole, current->hole, sizeof(mesh->hole)) != 0) {
+        buildGroundMesh(mesh, frame, current);
+    }
+
+    GLfloat mat_ambient[] = { 0.0, 0.0, 0.0, 0.0 };
+    GLfloat mat_diffuse[] = { 1.0, 1.0, 1.0, 1.0 }; 
+    GLfloat mat_specular[] = { 0.0, 0.0, 0.0, 1.0 };
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialf(GL_FRONT, GL_SHININESS, 0.0);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, mesh->vertices);
+    glNormalPointer(GL_FLOAT, 0, mesh->normals);
+    glColorPointer(3, GL_UNSIGNED_BYTE, 0, mesh->colors);
+    glDrawElements(GL_TRIANGLES, mesh->indexCount, GL_UNSIGNED_INT, mesh->indices);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+void radixSortBarrier() {
+    if (radixSort.workers > 1) {
+        pthread_barrier_wait(&radixSort.barrier);
+    }
+}
+
+// One worker's part of the sort. Every worker counts the digits of its
+// share, then for each pass scatters its share to where the counts of all
+// shares put it, keeping keys of equal digits in order.
+void radixSortShare(int worker) {
+    struct RadixSort* sort = &radixSort;
+    int first = (int)((long long)sort->count * worker / sort->workers);
+    int end = (int)((long long)sort->count * (worker + 1) / sort->workers);
+
+    // Digits of every pass in one read of the keys. Totalled over the
+    // shares they show which passes would leave the keys where they are.
+    memset(sort->digits[worker], 0, sizeof(sort->digits[worker]));
+    for (int i = first; i < end; i++) {
+        unsigned int key = sort->keys[0][i];
+        for (int pass = 0; pass < 4; pass++) {
+            sort->digits[worker][pass][(key >> (8 * pass)) & (RADIX_BUCKETS - 1)]++;
+        }
+    }
+    radixSortBarrier();
+
+    int source = 0;
+    bool moved = false;
+    for (int pass = 0; pass < 4; pass++) {
+        unsigned int totals[RADIX_BUCKETS] = { 0 };
+        bool uniform = false;
+        for (int digit = 0; digit < RADIX_BUCKETS; digit++) {
+            for (int w = 0; w < sort->workers; w++) {
+                totals[digit] += sort->digits[w][pass][digit];
+            }
+            uniform = uniform || totals[digit] == (unsigned int)sort->count;
+        }
+        if (uniform) {
+            continue;
+        }
+
+        // The counts taken up front only fit the shares until the first
+        // pass moves keys between them
+        unsigned int (*counts)[RADIX_BUCKETS] = sort->shares;
+        if (!moved) {
+            memcpy(counts[worker], sort->digits[worker][pass], sizeof(counts[worker]));
+        }
+        else {
+            memset(counts[worker], 0, sizeof(counts[worker]));
+            for (int i = first; i < end; i++) {
+                counts[worker][(sort->keys[source][i] >> (8 * pass)) & (RADIX_BUCKETS - 1)]++;
+            }
+        }
+        radixSortBarrier();
+
+        unsigned int offsets[RADIX_BUCKETS];
+        unsigned int offset = 0;
+        for (int digit = 0; digit < RADIX_BUCKETS; digit++) {
+            offsets[digit] = offset;
+            for (int w = 0; w < worker; w++) {
+                offsets[digit] += counts[w][digit];
+            }
+            offset += totals[digit];
+        }
+
+        const unsigned int* keys = sort->keys[source];
+        const unsigned int* values = sort->values[source];
+        for (int i = first; i < end; i++) {
+            unsigned int position = offsets[(keys[i] >> (8 * pass)) & (RADIX_BUCKETS - 1)]++;
+            sort->keys[source ^ 1][position] = keys[i];
+            sort->values[source ^ 1][position] = values[i];
+        }
+        source ^= 1;
+        moved = true;
+        radixSortBarrier();
+    }
+    if (worker == 0) {
+        sort->result = source;
+    }
+
+    // Nobody may still be reading when the next sort is set up
+    radixSortBarrier();
+}
+
+void* radixSortThread(void* arg) {
+    int worker = (int)(long)arg;
+    for (;;) {
+        pthread_barrier_wait(&radixSort.barrier);
+        radixSortShare(worker);
+    }
+    return NULL;
+}
+
+// Start a sort helper for each processor beyond the first, up to
+// SORT_WORKERS in all. Sorts stay on the render thread if they cannot be.
+void startRadixSortHelpers() {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = processors < SORT_WORKERS ? (processors > 1 ? (int)processors : 1) : SORT_WORKERS;
+    radixSort.threads = 1;
+    if (threads == 1 || pthread_barrier_init(&radixSort.barrier, NULL, threads) != 0) {
+        return;
+    }
+    for (int worker = 1; worker < threads; worker++) {
+        pthread_t helper;
+        if (pthread_create(&helper, NULL, radixSortThread, (void*)(long)worker) != 0) {
+            fprintf(stderr, "Error: Could not start the sort threads, sorting on one thread.\n");
+            return;
+        }
+        pthread_detach(helper);
+    }
+    radixSort.threads = threads;
+}
+
+// Sort the first count keys and values of the sort's first buffers,
+// leaving them in buffer radixSort.result
+void runRadixSort(int count) {
+    radixSort.count = count;
+    radixSort.workers = 1;
+    if (SORT_WORKERS > 1 && count >= PARALLEL_SORT_MIN) {
+        if (radixSort.threads == 0) {
+            startRadixSortHelpers();
+        }
+        if (radixSort.threads > 1) {
+            radixSort.workers = radixSort.threads;
+            pthread_barrier_wait(&radixSort.barrier);
+        }
+    }
+    radixSortShare(0);
+}
+
+// Draw the particles see-through, back to front by view-space depth and
+// without depth writes so those behind show through. The order is kept
+// while the same frame is drawn from the same view, as redraws that only
+// interpolate further towards it move particles too little to matter.
+// Otherwise every frame is sorted afresh: starting from the last frame's
+// order and fixing it up with an insertion sort was tried, but the stream's
+// particles pass each other in depth so often that the fix-up ran slower
+// than the radix sort even with the view held still.
+void renderTranslucentParticles(const struct RenderFrame* frame, float alpha) {
+    GLfloat matrix[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, matrix);
+
+    if (radixSort.capacity < frame->count) {
+        radixSort.capacity = frame->count * 2;
+        for (int i = 0; i < 2; i++) {
+            free(radixSort.keys[i]);
+            free(radixSort.values[i]);
+            radixSort.keys[i] = (unsigned int*)malloc(radixSort.capacity * sizeof(unsigned int));
+            radixSort.values[i] = (unsigned int*)malloc(radixSort.capacity * sizeof(unsigned int));
+            if (radixSort.keys[i] == NULL || radixSort.values[i] == NULL) {
+                fprintf(stderr, "Error: Memory allocation failed for the depth sort.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        depthOrder.publishMs = -1.0;
+    }
+
+    if (depthOrder.publishMs != frame->publishMs || depthOrder.count != frame->count ||
+        memcmp(depthOrder.matrix, matrix, sizeof(matrix)) != 0) {
+        // Eye-space z grows towards the viewer, so ascending z is back to
+        // front. Depths are stored in the key buffer until their range is
+        // known, then turned into 16-bit keys across it, finer than a
+        // particle for any scene that fits the view, so the top two passes
+        // have one digit and are skipped.
+        float* depths = (float*)radixSort.keys[0];
+        float nearest = -INFINITY;
+        float farthest = INFINITY;
+        for (int i = 0; i < frame->count; i++) {
+            const struct RenderParticle* particle = &frame->particles[i];
+            float x = lerp(particle->prevPosition[X], particle->position[X], alpha);
+            float y = lerp(particle->prevPosition[Y], particle->position[Y], alpha);
+            float z = lerp(particle->prevPosition[Z], particle->position[Z], alpha);
+            depths[i] = matrix[2] * x + matrix[6] * y + matrix[10] * z + matrix[14];
+            nearest = fmaxf(nearest, depths[i]);
+            farthest = fminf(farthest, depths[i]);
+        }
+        float scale = nearest > farthest ? 65535.0 / (nearest - farthest) : 0.0;
+        for (int i = 0; i < frame->count; i++) {
+            radixSort.keys[0][i] = (unsigned int)((depths[i] - farthest) * scale);
+            radixSort.values[0][i] = i;
+        }
+        runRadixSort(frame->count);
+        depthOrder.publishMs = frame->publishMs;
+        depthOrder.count = frame->count;
+        memcpy(depthOrder.matrix, matrix, sizeof(matrix));
+    }
+
+    const unsigned int* order = radixSort.values[radixSort.result];
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_FALSE);
+    for (int i = 0; i < frame->count; i++) {
+        renderParticle(&frame->particles[order[i]], alpha);
+    }
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+}
+
+// Lay out the line segments joining each point of TRAIL_BATCH trails of
+// the given length to the next. Every batch of trails is drawn with them.
+void buildTrailPattern(int stride) {
+    int perTrail = 2 * (stride - 1);
+    GLushort* indices = (GLushort*)realloc(trailPattern.indices, (size_t)TRAIL_BATCH * perTrail * sizeof(GLushort));
+    if (indices == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for the trail pattern.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int trail = 0; trail < TRAIL_BATCH; trail++) {
+        for (int i = 0; i + 1 < stride; i++) {
+            indices[trail * perTrail + 2 * i] = (GLushort)(trail * stride + i);
+            indices[trail * perTrail + 2 * i + 1] = (GLushort)(trail * stride + i + 1);
+        }
+    }
+    trailPattern.indices = indices;
+    trailPattern.stride = stride;
+}
+
+// Draw the particle trails as line segments, a batch of TRAIL_BATCH trails
+// per call over the same index pattern
+void renderTrails(const struct RenderFrame* frame) {
+    int stride = frame->trailStride;
+    if (stride == 0 || frame->count == 0) {
+        return;
+    }
+    if (trailPattern.stride != stride) {
+        buildTrailPattern(stride);
+    }
+
+    glDisable(GL_LIGHTING);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    for (int first = 0; first < frame->count; first += TRAIL_BATCH) {
+        int trails = frame->count - first < TRAIL_BATCH ? frame->count - first : TRAIL_BATCH;
+        glVertexPointer(3, GL_FLOAT, 0, frame->trailPoints[(size_t)first * stride]);
+        glColorPointer(4, GL_UNSIGNED_BYTE, 0, frame->trailColors[(size_t)first * stride]);
+        glDrawElements(GL_LINES, trails * 2 * (stride - 1), GL_UNSIGNED_SHORT, trailPattern.indices);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisable(GL_BLEND);
+    glEnable(GL_LIGHTING);
+}
+
+void renderSphere() {
+    const struct Scene* current = scene;
+    GLfloat mat_ambient[] = { 0.3, 0.3, 0.3, 1.0 };    
+    GLfloat mat_diffuse[] = { 0.8, 0.8, 0.8, 1.0 };   
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };  
+    GLfloat mat_shininess = 50.0;
+
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialf(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    for (int i = 0; i < current->sphereCount; i++) {
+        glPushMatrix();
+        glColor3fv(current->spheres[i].color);
+        glTranslatef(current->spheres[i].center[X], current->spheres[i].center[Y], current->spheres[i].center[Z]);
+        int slices = qualityLevels[governor.level].sphereSlices;
+        glutSolidSphere(current->sphereRadius, slices, slices);
+        glPopMatrix();
+    }
+}
+
+// Draw the meshes from the arrays built when they were loaded
+void renderMeshes() {
+    const struct Scene* current = scene;
+    if (current->meshCount == 0) {
+        return;
+    }
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glVertexPointer(3, GL_FLOAT, 0, current->geometry->vertices);
+    glNormalPointer(GL_FLOAT, 0, current->geometry->normals);
+    for (int i = 0; i < current->meshCount; i++) {
+        glColor3fv(current->meshes[i].color);
+        glDrawArrays(GL_TRIANGLES, current->meshes[i].first * 3, current->meshes[i].count * 3);
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+// Draw a cube under each emitter
+void renderFountain() {
+    const struct Scene* current = scene;
+    glColor3f(0.0, 0.0, 1.0);
+    for (int i = 0; i < current->emitterCount; i++) {
+        const float* position = current->emitters[i].position;
+        glPushMatrix();
+        glTranslatef(position[X], position[Y] - 0.5, position[Z]);
+        glutSolidCube(1.0);
+        glPopMatrix();
+    }
+}
+
+const char* maxLifetimeLabel() {
+    static char label[32];
+    if (maxLifetime <= 0.0) {
+        return "Unlimited";
+    }
+    snprintf(label, sizeof(label), "%d ms", (int)maxLifetime * TICK_MS);
+    return label;
+}
+
+const char* trailLengthLabel() {
+    static char label[32];
+    if (trailLength <= 0) {
+        return "Disabled";
+    }
+    snprintf(label, sizeof(label), "%d frames", (int)trailLength);
+    return label;
+}
+
+const char* sortIntervalLabel() {
+    static char label[32];
+    if (sortInterval <= 0) {
+        return "Disabled";
+    }
+    snprintf(label, sizeof(label), "%d ms per chunk", sortInterval * TICK_MS);
+    return label;
+}
+
+void appendText(char* buffer, size_t size, const char* format, ...) {
+    size_t length = strlen(buffer);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buffer + length, size - length, format, args);
+    va_end(args);
+}
+
+// Keyboard commands and the state of each mode, one per line
+void formatKeyboardOptions(char* buffer, size_t size) {
+    buffer[0] = '\0';
+    appendText(buffer, size, "Keyboard Options:\n\n");
+    appendText(buffer, size, "f: Fire particle(s) (hold for continuous, manual mode only)\n");
+    appendText(buffer, size, "c: Toggle constant stream mode: %s\n", constantStream ? "Enabled" : "Disabled");
+    appendText(buffer, size, "m: Toggle manual firing/single shot mode: %s\n", manualFiring ? "Enabled" : "Disabled");
+    appendText(buffer, size, "s: Toggle random speed mode: %s\n", randomSpeedMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "w: Toggle spray mode: %s\n", !sprayMode ? "Low" : "High");
+    appendText(buffer, size, "p: Toggle random particle spin mode: %s\n", randomSpinMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "b: Toggle backface culling: %s\n", backfaceCulling ? "Enabled" : "Disabled");
+    appendText(buffer, size, "g: Toggle friction mode %s\n", frictionMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "j: Toggle ground deposition: %s\n", depositionMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "l: Toggle shading mode: %s\n", currentShadingMode == 0 ? "Flat" :"Gouraud");
+    appendText(buffer, size, "d: Cycle simulation timestep: %d ms\n", simStepTicks * TICK_MS);
+    appendText(buffer, size, "e: Toggle event-driven trajectories: %s\n", eventDrivenMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "o: Toggle level of detail update rates: %s\n", lodMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "[, ]: Halve or double the LOD error budget: %.3g pixels\n", lodErrorBudget);
+    appendText(buffer, size, "k: Cycle particle lifetime: %s\n", maxLifetimeLabel());
+    appendText(buffer, size, ";: Cycle particle trail length: %s\n", trailLengthLabel());
+    appendText(buffer, size, "n: Cycle Morton re-sort interval: %s\n", sortIntervalLabel());
+    appendText(buffer, size, "a: Toggle frame-time governor: %s\n", governor.enabled ? "Enabled" : "Disabled");
+    appendText(buffer, size, "h: Toggle shared-memory export to %s: %s\n", SHARED_MEMORY_NAME, exportMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "i: Toggle render interpolation: %s\n", interpolationMode ? "Enabled" : "Disabled");
+    appendText(buffer, size, "u: Toggle this status panel\n");
+    appendText(buffer, size, "t: Reset the simulation\n\n");
+    appendText(buffer, size, "v: Toggle particle view: %s\n", particleView ? "Enabled" : "Disabled");
+    appendText(buffer, size, "x, y, z: rotate about x, y, or z axis\n");
+    appendText(buffer, size, "Left mouse: rotate clockwise faster\n");
+    appendText(buffer, size, "Right mouse: rotate counter-clockwise faster\n");
+    appendText(buffer, size, "r: reset perspective\n\n");
+    appendText(buffer, size, "1, 2, 3, 4: Render particles as points, wireframe, solid or translucent: %s\n\n", 
+        currentRenderMode == 1 ? "Points" : currentRenderMode == 2 ? "Wireframe" : currentRenderMode == 3 ? "Solid" : "Translucent");
+    appendText(buffer, size, "q: Exit the program\n");
+}
+
+// Print keyboard commands to console for user
+void printKeyboardOptions() {
+    char text[STATUS_TEXT_SIZE];
+    formatKeyboardOptions(text, sizeof(text));
+    fputs(text, stdout);
+}
+
+// Whether the GL context lists the extension
+bool hasGlExtension(const char* name) {
+    const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+    size_t length = strlen(name);
+    for (const char* found = extensions; found != NULL && (found = strstr(found, name)) != NULL; found += length) {
+        if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rasterize the HUD fonts into the glyph atlas texture. Each glyph is drawn
+// once with glutBitmapCharacter into an offscreen framebuffer and read back;
+// the window's own buffers are not used, as pixels of them that are hidden
+// or off-screen are undefined when read. Without framebuffer objects the
+// texture is left at 0 and text is drawn glyph by glyph instead.
+void buildGlyphAtlas() {
+    glyphAtlas.built = true;
+    if (!hasGlExtension("GL_EXT_framebuffer_object")) {
+        fprintf(stderr, "Error: No framebuffer objects for the glyph atlas, HUD text is drawn unbatched.\n");
+        return;
+    }
+
+    GLuint framebuffer;
+    GLuint renderbuffer;
+    glGenFramebuffersEXT(1, &framebuffer);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, framebuffer);
+    glGenRenderbuffersEXT(1, &renderbuffer);
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, renderbuffer);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, renderbuffer);
+    if (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) != GL_FRAMEBUFFER_COMPLETE_EXT) {
+        fprintf(stderr, "Error: Could not set up a framebuffer for the glyph atlas, HUD text is drawn unbatched.\n");
+        glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+        glDeleteRenderbuffersEXT(1, &renderbuffer);
+        glDeleteFramebuffersEXT(1, &framebuffer);
+        return;
+    }
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    glViewport(0, 0, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, GLYPH_ATLAS_SIZE, 0, GLYPH_ATLAS_SIZE, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+
+    glClear(GL_COLOR_BUFFER_BIT);
+    glColor3f(1, 1, 1);
+
+    // Pack the glyphs in rows, each font's cells as tall as its lines
+    int x = 0;
+    int y = 0;
+    for (int f = 0; f < HUD_FONT_COUNT; f++) {
+        struct AtlasFont* font = &glyphAtlas.fonts[f];
+        for (int i = 0; i < GLYPH_COUNT; i++) {
+            int width = glutBitmapWidth(font->font, FIRST_GLYPH + i) + 2;
+            if (x + width > GLYPH_ATLAS_SIZE) {
+                x = 0;
+                y += font->lineHeight;
+            }
+            font->glyphs[i] = (struct Glyph){ x, y, width };
+
+            // One pixel of room on the left for glyphs that hang over their origin
+            glRasterPos2i(x + 1, y + font->descent);
+            glutBitmapCharacter(font->font, FIRST_GLYPH + i);
+            x += width;
+        }
+        x = 0;
+        y += font->lineHeight;
+    }
+    if (y > GLYPH_ATLAS_SIZE) {
+        fprintf(stderr, "Error: HUD fonts do not fit in the glyph atlas.\n");
+    }
+
+    unsigned char* pixels = (unsigned char*)calloc(GLYPH_ATLAS_SIZE * GLYPH_ATLAS_SIZE, 1);
+    if (pixels == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for the glyph atlas.\n");
+        exit(EXIT_FAILURE);
+    }
+    glReadPixels(0, 0, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, GL_RED, GL_UNSIGNED_BYTE, pixels);
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    glDeleteRenderbuffersEXT(1, &renderbuffer);
+    glDeleteFramebuffersEXT(1, &framebuffer);
+
+    glGenTextures(1, &glyphAtlas.texture);
+    glBindTexture(GL_TEXTURE_2D, glyphAtlas.texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE, 0,
+        GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
+    free(pixels);
+
+    glEnable(GL_LIGHTING);
+    glEnable(GL_DEPTH_TEST);
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glViewport(0, 0, windowWidth, windowHeight);
+}
+
+// Draw the text glyph by glyph with glutBitmapCharacter, with the first
+// line's baseline at (x, y) in window pixels, where there is no atlas
+void drawBitmapText(int fontIndex, float x, float y, const char* text) {
+    const struct AtlasFont* font = &glyphAtlas.fonts[fontIndex];
+    glRasterPos2f(x, y);
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '\n') {
+            y -= font->lineHeight;
+            glRasterPos2f(x, y);
+        }
+        else {
+            glutBitmapCharacter(font->font, *c);
+        }
+    }
+}
+
+// Append the text's glyph quads to the batch, with the first line's
+// baseline at (x, y) in window pixels
+void addText(int fontIndex, float x, float y, const char* text) {
+    const struct AtlasFont* font = &glyphAtlas.fonts[fontIndex];
+    int length = strlen(text);
+
+    if (textBatch.count + 4 * length > textBatch.capacity) {
+        int capacity = (textBatch.count + 4 * length) * 2;
+        struct TextVertex* vertices = (struct TextVertex*)realloc(textBatch.vertices,
+            capacity * sizeof(struct TextVertex));
+        if (vertices == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for the HUD text.\n");
+            exit(EXIT_FAILURE);
+        }
+        textBatch.vertices = vertices;
+        textBatch.capacity = capacity;
+    }
+
+    float penX = x;
+    for (const char* c = text; *c != '\0'; c++) {
+        if (*c == '\n') {
+            penX = x;
+            y -= font->lineHeight;
+            continue;
+        }
+        if (*c < FIRST_GLYPH || *c >= FIRST_GLYPH + GLYPH_COUNT) {
+            continue;
+        }
+
+        const struct Glyph* glyph = &font->glyphs[*c - FIRST_GLYPH];
+        float u0 = (float)glyph->x / GLYPH_ATLAS_SIZE;
+        float u1 = (float)(glyph->x + glyph->width) / GLYPH_ATLAS_SIZE;
+        float v0 = (float)glyph->y / GLYPH_ATLAS_SIZE;
+        float v1 = (float)(glyph->y + font->lineHeight) / GLYPH_ATLAS_SIZE;
+        float left = penX - 1.0;
+        float bottom = y - font->descent;
+
+        struct TextVertex* quad = &textBatch.vertices[textBatch.count];
+        quad[0] = (struct TextVertex){ u0, v0, left, bottom };
+        quad[1] = (struct TextVertex){ u1, v0, left + glyph->width, bottom };
+        quad[2] = (struct TextVertex){ u1, v1, left + glyph->width, bottom + font->lineHeight };
+        quad[3] = (struct TextVertex){ u0, v1, left, bottom + font->lineHeight };
+        textBatch.count += 4;
+
+        penX += glyph->width - 2;
+    }
+}
+
+// Draw the HUD: the status panel, whose quads stay at the front of the text
+// batch until a mode changes, and the per-frame readouts, all in one draw call,
+// or glyph by glyph where there is no atlas.
+// Overlay set up adapted from:
+// https://stackoverflow.com/questions/20082576/how-to-overlay-text-in-opengl
+void renderCount(const struct RenderFrame* frame) {
+    char particleCount[50];
+    snprintf(particleCount, sizeof(particleCount), "Particle Count: %d", frame->count);
+
+    const struct QualityLevel* quality = &qualityLevels[governor.level];
+    char frameCost[100];
+    snprintf(frameCost, sizeof(frameCost), "Frame: %.1f / %.1f ms  Quality: %d%s  Emission: %.0f%%",
+        governor.averageMs, governor.budgetMs, governor.level, governor.enabled ? "" : " (off)",
+        quality->emission * 100.0);
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    glOrtho(0, windowWidth, 0, windowHeight, -1, 1);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glColor3f(1, 1, 1);
+
+    if (glyphAtlas.texture == 0) {
+        if (statusPanel) {
+            char text[STATUS_TEXT_SIZE];
+            formatKeyboardOptions(text, sizeof(text));
+            drawBitmapText(HUD_FONT_SMALL, 20.0, windowHeight - 30.0, text);
+        }
+        drawBitmapText(HUD_FONT_LARGE, 20.0, 20.0, particleCount);
+        drawBitmapText(HUD_FONT_LARGE, 20.0, 50.0, frameCost);
+    }
+    else {
+        if (statusPanelDirty) {
+            textBatch.count = 0;
+            if (statusPanel) {
+                char text[STATUS_TEXT_SIZE];
+                formatKeyboardOptions(text, sizeof(text));
+                addText(HUD_FONT_SMALL, 20.0, windowHeight - 30.0, text);
+            }
+            textBatch.panelCount = textBatch.count;
+            statusPanelDirty = false;
+        }
+        textBatch.count = textBatch.panelCount;
+        addText(HUD_FONT_LARGE, 20.0, 20.0, particleCount);
+        addText(HUD_FONT_LARGE, 20.0, 50.0, frameCost);
+
+        glEnable(GL_TEXTURE_2D);
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glBindTexture(GL_TEXTURE_2D, glyphAtlas.texture);
+
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(struct TextVertex), &textBatch.vertices[0].u);
+        glVertexPointer(2, GL_FLOAT, sizeof(struct TextVertex), &textBatch.vertices[0].x);
+        glDrawArrays(GL_QUADS, 0, textBatch.count);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+
+        glDisable(GL_BLEND);
+        glDisable(GL_TEXTURE_2D);
+    }
+    glEnable(GL_LIGHTING);
+    glEnable(GL_DEPTH_TEST);
+
+    glMatrixMode(GL_MODELVIEW);
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+}
+
+void renderScene() {
+    double renderStart = currentTimeMs();
+
+    if (!glyphAtlas.built) {
+        buildGlyphAtlas();
+    }
+
+    // Draw the most recent frame the simulation thread has finished
+    tripleBufferAcquire(&renderBuffer);
+    const struct RenderFrame* frame = &renderFrames[renderBuffer.front];
+
+    // Draw one simulation step behind, blending from the frame before
+    // towards this one as the time until the next step runs out
+    float alpha = 1.0;
+    if (interpolationMode && frame->stepMs > 0.0) {
+        alpha = fminf((renderStart - frame->publishMs) / frame->stepMs, 1.0);
+    }
+
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    // Apply rotation
+    glMatrixMode(GL_MODELVIEW);
+    glRotatef(global.angle[X], 1.0, 0.0, 0.0);
+    glRotatef(global.angle[Y], 0.0, 1.0, 0.0);
+    glRotatef(global.angle[Z], 0.0, 0.0, 1.0);
+
+    if (lodMode) {
+        struct ViewState* view = &viewStates[viewBuffer.back];
+        glGetFloatv(GL_MODELVIEW_MATRIX, view->matrix);
+        view->pixelsPerUnit = windowHeight / (2.0 * 0.4142);
+        tripleBufferPublish(&viewBuffer);
+    }
+
+    renderGround(frame);
+    renderFountain();
+    renderSphere();
+    renderMeshes();
+
+    renderTrails(frame);
+
+    // Render particles
+    if (currentRenderMode == 4 && !qualityLevels[governor.level].pointParticles) {
+        renderTranslucentParticles(frame, alpha);
+    }
+    else {
+        for (int i = 0; i < frame->count; i++) {
+            renderParticle(&frame->particles[i], alpha);
+        }
+    }
+
+    // Particle view, holding the last view once the particle is gone
+    if (particleView && frame->hasSelected) {
+        glMatrixMode(GL_MODELVIEW);
+        glLoadIdentity();
+        gluLookAt(
+            lerp(frame->prevSelected[X], frame->selected[X], alpha) + 1.0,
+            lerp(frame->prevSelected[Y], frame->selected[Y], alpha) + 1.0,
+            lerp(frame->prevSelected[Z], frame->selected[Z], alpha) + 1.0,
+            0, 0, 0, 0.0, 1.0, 0.0);
+    }
+    renderCount(frame);
+
+    // The swap is left out as it may wait for the display
+    double renderMs = currentTimeMs() - renderStart;
+    governFrame(renderMs, frame->simMs);
+    addThreadMetric(METRIC_THREAD_RENDER, METRIC_FRAMES, 1);
+    addThreadMetric(METRIC_THREAD_RENDER, METRIC_RENDER_NS, (unsigned long long)(renderMs * 1e6));
+    atomic_fetch_add(&framesDrawn, 1);
+
+    glutSwapBuffers();
+}
+
+void toggleParticleView() {
+    if (!particleView) {
+        atomic_fetch_or(&pendingCommands, COMMAND_SELECT_PARTICLE);
+        particleView = true;
+        // Save current modelview matrix
+        glGetFloatv(GL_MODELVIEW_MATRIX, savedModelviewMatrix);
+    }
+    else {
+        particleView = false;
+        // Restore saved modelview matrix
+        glMatrixMode(GL_MODELVIEW);
+        glLoadMatrixf(savedModelviewMatrix);
+    }
+}
+
+// Queue a spawn command from any thread. Never blocks; returns false and
+// drops the command if the queue is full.
+bool requestSpawn(int emitter, int count, int age) {
+    unsigned int pos = atomic_load_explicit(&spawnQueue.enqueuePos, memory_order_relaxed);
+
+    for (;;) {
+        unsigned int index = pos & (SPAWN_QUEUE_SIZE - 1);
+        struct SpawnCell* cell = &spawnQueue.cells[index];
+        unsigned int ready = pos - index;
+        int lag = (int)(atomic_load_explicit(&cell->turn, memory_order_acquire) - ready);
+
+        if (lag == 0) {
+            // A failed exchange reloads pos
+            if (atomic_compare_exchange_weak_explicit(&spawnQueue.enqueuePos, &pos, pos + 1,
+                memory_order_relaxed, memory_order_relaxed)) {
+                cell->command = (struct SpawnCommand){ emitter, count, age };
+                atomic_store_explicit(&cell->turn, ready + 1, memory_order_release);
+                return true;
+            }
+        }
+        else if (lag < 0) {
+            // The consumer has not read this cell's command from the last lap
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&spawnQueue.enqueuePos, memory_order_relaxed);
+        }
+    }
+}
+
+// Take the oldest spawn command, simulation thread only
+bool spawnQueuePop(struct SpawnCommand* command) {
+    unsigned int pos = spawnQueue.dequeuePos;
+    unsigned int index = pos & (SPAWN_QUEUE_SIZE - 1);
+    struct SpawnCell* cell = &spawnQueue.cells[index];
+
+    if (atomic_load_explicit(&cell->turn, memory_order_acquire) != pos - index + 1) {
+        return false;
+    }
+    *command = cell->command;
+    atomic_store_explicit(&cell->turn, pos - index + SPAWN_QUEUE_SIZE, memory_order_release);
+    spawnQueue.dequeuePos = pos + 1;
+    return true;
+}
+
+// keyboard commands
+void keyboard(unsigned char key, int x, int y) {
+    switch (key) {
+    case 'w':
+        sprayMode = !sprayMode;
+        statusPanelDirty = true;
+        break;
+    case 'l':
+        toggleShadingMode();
+        statusPanelDirty = true;
+        break;
+    case 'v':       
+        toggleParticleView();
+        statusPanelDirty = true;
+        break;
+    case 'b':
+        toggleBackfaceCulling();
+        statusPanelDirty = true;
+        break;
+    case 'x':
+        global.axis = X;
+        break;
+    case 'y':
+        global.axis = Y;
+        break;
+    case 'z':
+        global.axis = Z;
+        break;
+    case 's':
+        randomSpeedMode = !randomSpeedMode;
+        statusPanelDirty = true;
+        break;
+    case 'f':
+        if (manualFiring) {
+            int emitterCount = scene->emitterCount;
+            for (int i = 0; i < emitterCount; i++) {
+                requestSpawn(i, 1, 0);
+            }
+        }
+        break;
+    case 'c':
+        constantStream = !constantStream;
+        statusPanelDirty = true;
+        break;
+    case 'm':
+        manualFiring = !manualFiring;
+        statusPanelDirty = true;
+        break;
+    case 'p':
+        randomSpinMode = !randomSpinMode;
+        statusPanelDirty = true;
+        break;
+    case 't':
+        atomic_fetch_or(&pendingCommands, COMMAND_RESET);
+        break;
+    case 'd':
+        simStepTicks = simStepTicks % MAX_STEP_TICKS + 1;
+        statusPanelDirty = true;
+        break;
+    case 'e':
+        atomic_fetch_or(&pendingCommands, COMMAND_TOGGLE_EVENTS);
+        break;
+    case 'o':
+        atomic_fetch_or(&pendingCommands, COMMAND_TOGGLE_LOD);
+        break;
+    case '[':
+        lodErrorBudget = lodErrorBudget * 0.5;
+        statusPanelDirty = true;
+        break;
+    case ']':
+        lodErrorBudget = lodErrorBudget * 2.0;
+        statusPanelDirty = true;
+        break;
+    case 'k':
+        // Unlimited, then 2, 4 and 8 seconds
+        maxLifetime = maxLifetime >= 500.0 ? 0.0 : maxLifetime <= 0.0 ? 125.0 : maxLifetime * 2.0;
+        statusPanelDirty = true;
+        break;
+    case 'n':
+        // Disabled, then every 15, 60 and 240 ticks
+        sortInterval = sortInterval >= 240 ? 0 : sortInterval <= 0 ? 15 : sortInterval * 4;
+        statusPanelDirty = true;
+        break;
+    case 'h':
+        atomic_fetch_or(&pendingCommands, COMMAND_TOGGLE_EXPORT);
+        break;
+    case ';':
+        atomic_fetch_or(&pendingCommands, COMMAND_CYCLE_TRAILS);
+        break;
+    case 'i':
+        interpolationMode = !interpolationMode;
+        statusPanelDirty = true;
+        break;
+    case 'u':
+        statusPanel = !statusPanel;
+        statusPanelDirty = true;
+        break;
+    case 'a':
+        toggleGovernor();
+        statusPanelDirty = true;
+        break;
+    case 'g':
+        frictionMode = !frictionMode;
+        statusPanelDirty = true;
+        break;
+    case 'j':
+        depositionMode = !depositionMode;
+        statusPanelDirty = true;
+        break;
+    case 'r':
+        global.angle[X] = 0.0;
+        global.angle[Y] = 0.0;
+        global.angle[Z] = 0.0;
+        glPopMatrix();
+        glPushMatrix();
+        glLoadIdentity();
+        lookFromCamera(scene);
+        break;
+    case '1':
+        currentRenderMode = 1;
+        statusPanelDirty = true;
+        break;
+    case '2':
+        currentRenderMode = 2;
+        statusPanelDirty = true;
+        break;
+    case '3':
+        currentRenderMode = 3;
+        statusPanelDirty = true;
+        break;
+    case '4':
+        currentRenderMode = 4;
+        statusPanelDirty = true;
+        break;
+    case 'q':
+        exit(0);
+        break;
+    }
+}
+
+void freeScene(struct Scene* freed) {
+    if (freed == NULL) {
+        return;
+    }
+    for (int f = 0; f < freed->fieldCount; f++) {
+        free(freed->fields[f].grid);
+    }
+    if (freed->sdf != NULL) {
+        free(freed->sdf->samples);
+        free(freed->sdf);
+    }
+    if (freed->geometry != NULL) {
+        free(freed->geometry->vertices);
+        free(freed->geometry->normals);
+        free(freed->geometry->triangles);
+        free(freed->geometry->nodes);
+        free(freed->geometry);
+    }
+    free(freed);
+}
+
+// Free the replaced scenes the renderer can no longer be drawing from. It
+// takes one snapshot of the scene per use within a frame, so once it has
+// finished SCENE_GRACE_FRAMES frames since a scene was replaced, none of its
+// snapshots can still point at it.
+void freeRetiredScenes() {
+    unsigned int drawn = atomic_load(&framesDrawn);
+    for (struct Scene** link = &retiredScenes; *link != NULL; ) {
+        struct Scene* retired = *link;
+        if (drawn - retired->retiredAtFrame >= SCENE_GRACE_FRAMES) {
+            *link = retired->nextRetired;
+            freeScene(retired);
+        }
+        else {
+            link = &retired->nextRetired;
+        }
+    }
+}
+
+// Switch to a reloaded scene. Pending events and LOD updates were planned
+// with the old physics, so particles are first brought up to date under it
+// and then rescheduled under the new one.
+void applyScene(const struct Scene* next) {
+    bool events = eventDrivenMode;
+    bool lod = lodMode;
+    if (events) {
+        toggleEventDrivenMode();
+    }
+    if (lod) {
+        toggleLodMode();
+    }
+
+    // The renderer may still be drawing from the old scene, so it is freed later
+    const struct Scene* old = scene;
+    scene = next;
+    clearDeposit();
+    if (old != &defaultScene) {
+        struct Scene* retired = (struct Scene*)old;
+        retired->retiredAtFrame = atomic_load(&framesDrawn);
+        retired->nextRetired = retiredScenes;
+        retiredScenes = retired;
+    }
+
+    if (lod) {
+        toggleLodMode();
+    }
+    if (events) {
+        toggleEventDrivenMode();
+    }
+}
+
+// Apply the changes requested by the input handlers since the last tick
+void applySimCommands() {
+    struct Scene* next = atomic_exchange(&pendingScene, NULL);
+    if (next != NULL) {
+        applyScene(next);
+    }
+    if (retiredScenes != NULL) {
+        freeRetiredScenes();
+    }
+
+    int commands = atomic_exchange(&pendingCommands, 0);
+
+    if (commands & COMMAND_RESET) {
+        resetSimulation();
+    }
+    if (commands & COMMAND_TOGGLE_EVENTS) {
+        toggleEventDrivenMode();
+    }
+    if (commands & COMMAND_TOGGLE_LOD) {
+        toggleLodMode();
+    }
+    if (commands & COMMAND_TOGGLE_EXPORT) {
+        toggleExportMode();
+    }
+    if (commands & COMMAND_CYCLE_TRAILS) {
+        cycleTrailLength();
+    }
+    if (commands & COMMAND_SELECT_PARTICLE) {
+        // Follow the newest live particle
+        for (unsigned int seq = particleList.head; seq != particleList.tail; ) {
+            seq--;
+            if (!isParticleRetired(seq)) {
+                selectedParticle = particleHandle(seq);
+                break;
+            }
+        }
+    }
+    if (commands != 0) {
+        atomic_store(&optionsChanged, true);
+    }
+
+    struct SpawnCommand command;
+    while (spawnQueuePop(&command)) {
+        if (command.emitter >= scene->emitterCount) {
+            continue;
+        }
+        for (int i = 0; i < command.count; i++) {
+            emitParticle(command.emitter, command.age);
+        }
+    }
+
+    if (tripleBufferAcquire(&viewBuffer)) {
+        lodView = viewStates[viewBuffer.front];
+    }
+}
+
+// Advance the simulation by one update and publish the result
+void simulateTick(int ticks) {
+    double simStart = currentTimeMs();
+
+    applySimCommands();
+    double updateStart = currentTimeMs();
+    updateFrame(ticks);
+    double emitStart = currentTimeMs();
+
+    if (constantStream && !manualFiring) {
+        // One particle per tick at full quality: each particle of the batch
+        // is advanced by the ticks it would already have been flying
+        for (int e = 0; e < scene->emitterCount; e++) {
+            const struct Emitter* emitter = &scene->emitters[e];
+            governor.emissionCredit[e] += qualityLevels[governor.level].emission * emitter->rate * ticks;
+            int count = (int)governor.emissionCredit[e];
+            governor.emissionCredit[e] -= count;
+            for (int i = count; i > 0; i--) {
+                emitParticle(e, i * ticks / count);
+            }
+        }
+    }
+
+    double publishStart = currentTimeMs();
+    publishRenderFrame(publishStart - simStart, TICK_MS * ticks);
+
+    tickMetrics[METRIC_TICKS]++;
+    tickMetrics[METRIC_COMMANDS_NS] += (unsigned long long)((updateStart - simStart) * 1e6);
+    tickMetrics[METRIC_UPDATE_NS] += (unsigned long long)((emitStart - updateStart) * 1e6);
+    tickMetrics[METRIC_EMIT_NS] += (unsigned long long)((publishStart - emitStart) * 1e6);
+    tickMetrics[METRIC_PUBLISH_NS] += (unsigned long long)((currentTimeMs() - publishStart) * 1e6);
+    flushTickMetrics();
+}
+
+// Simulation thread: runs the fixed timestep updates while the GLUT thread
+// draws the last completed frame
+void* simulationThread(void* arg) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+    for (;;) {
+        int ticks = simStepTicks;
+        simulateTick(ticks);
+
+        // 60 updates per second at the finest timestep
+        deadline.tv_nsec += (long)TICK_MS * ticks * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        // Drop the backlog rather than racing to catch up after a stall
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > deadline.tv_sec + 1) {
+            deadline = now;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+    return NULL;
+}
+
+// Redraw whenever the simulation thread has published a new frame, or with
+// interpolation on, as often as the display allows up to MAX_RENDER_HZ
+void idleFunc() {
+    static double lastRedisplayMs = 0.0;
+
+    if (atomic_exchange(&optionsChanged, false)) {
+        statusPanelDirty = true;
+    }
+
+    double now = currentTimeMs();
+    bool fresh = atomic_load(&renderBuffer.middle) & TRIPLE_BUFFER_FRESH;
+    if (fresh || (interpolationMode && now - lastRedisplayMs >= 1000.0 / MAX_RENDER_HZ)) {
+        lastRedisplayMs = now;
+        glutPostRedisplay();
+    }
+    else {
+        struct timespec pause = { 0, 1000000L };
+        nanosleep(&pause, NULL);
+    }
+}
+
+void reshape(int w, int h) {
+    windowWidth = w;
+    windowHeight = h;
+    glViewport(0, 0, w, h);
+
+    // The status panel hangs from the top of the window
+    statusPanelDirty = true;
+}
+
+//mouse function from example code rotate2.c
+void mouse(int btn, int state, int x, int y) {
+    if (state == GLUT_DOWN) {
+        if (btn == GLUT_LEFT_BUTTON) {
+            global.angle[global.axis] = global.angle[global.axis] + 0.2;
+        }
+        else if (btn == GLUT_RIGHT_BUTTON) {
+            global.angle[global.axis] = global.angle[global.axis] - 0.2;
+        }
+    }
+}
+
+// Initialise light settings
+void lightInit() {
+    GLfloat position[] = { 0.0, 1.0, 0.0, 0.0 };
+    GLfloat ambient[] = { 0.1, 0.1, 0.1, 1.0 };
+    GLfloat diffuse[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat lmodel_ambient[] = { 0.2, 0.2, 0.2, 1.0 };
+
+    glLightfv(GL_LIGHT0, GL_POSITION, position);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
+    glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, lmodel_ambient);
+
+    glEnable(GL_COLOR_MATERIAL);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);    
+}
+
+unsigned long long metricTotal(int metric) {
+    unsigned long long total = 0;
+    for (int thread = 0; thread < METRIC_THREAD_COUNT; thread++) {
+        total += atomic_load_explicit(&threadMetrics[thread].counters[metric], memory_order_relaxed);
+    }
+    return total;
+}
+
+// Format the metrics in the Prometheus text exposition format
+int formatMetrics(char* buffer, size_t size) {
+    return snprintf(buffer, size,
+        "# HELP particle_fountain_particles Live particles.\n"
+        "# TYPE particle_fountain_particles gauge\n"
+        "particle_fountain_particles %d\n"
+        "# HELP particle_fountain_spawns_total Particles emitted.\n"
+        "# TYPE particle_fountain_spawns_total counter\n"
+        "particle_fountain_spawns_total %llu\n"
+        "# HELP particle_fountain_deaths_total Particles that died, by cause.\n"
+        "# TYPE particle_fountain_deaths_total counter\n"
+        "particle_fountain_deaths_total{cause=\"stopped\"} %llu\n"
+        "particle_fountain_deaths_total{cause=\"fell\"} %llu\n"
+        "particle_fountain_deaths_total{cause=\"expired\"} %llu\n"
+        "particle_fountain_deaths_total{cause=\"deposited\"} %llu\n"
+        "# HELP particle_fountain_collisions_total Collisions resolved, by collider.\n"
+        "# TYPE particle_fountain_collisions_total counter\n"
+        "particle_fountain_collisions_total{collider=\"ground\"} %llu\n"
+        "particle_fountain_collisions_total{collider=\"sphere\"} %llu\n"
+        "particle_fountain_collisions_total{collider=\"sdf\"} %llu\n"
+        "particle_fountain_collisions_total{collider=\"mesh\"} %llu\n"
+        "# HELP particle_fountain_ticks_total Simulation updates run.\n"
+        "# TYPE particle_fountain_ticks_total counter\n"
+        "particle_fountain_ticks_total %llu\n"
+        "# HELP particle_fountain_stage_seconds_total Time spent in each stage of the simulation update.\n"
+        "# TYPE particle_fountain_stage_seconds_total counter\n"
+        "particle_fountain_stage_seconds_total{stage=\"commands\"} %.9f\n"
+        "particle_fountain_stage_seconds_total{stage=\"update\"} %.9f\n"
+        "particle_fountain_stage_seconds_total{stage=\"emit\"} %.9f\n"
+        "particle_fountain_stage_seconds_total{stage=\"publish\"} %.9f\n"
+        "# HELP particle_fountain_frames_total Frames drawn.\n"
+        "# TYPE particle_fountain_frames_total counter\n"
+        "particle_fountain_frames_total %llu\n"
+        "# HELP particle_fountain_render_seconds_total Time spent drawing frames, without the swap.\n"
+        "# TYPE particle_fountain_render_seconds_total counter\n"
+        "particle_fountain_render_seconds_total %.9f\n"
+        "# HELP particle_fountain_quality_level Frame-time governor quality level, 0 is full quality.\n"
+        "# TYPE particle_fountain_quality_level gauge\n"
+        "particle_fountain_quality_level %d\n",
+        atomic_load_explicit(&particleGauge, memory_order_relaxed),
+        metricTotal(METRIC_SPAWNS),
+        metricTotal(METRIC_DEATHS_STOPPED),
+        metricTotal(METRIC_DEATHS_FELL),
+        metricTotal(METRIC_DEATHS_EXPIRED),
+        metricTotal(METRIC_DEATHS_DEPOSITED),
+        metricTotal(METRIC_GROUND_COLLISIONS),
+        metricTotal(METRIC_SPHERE_COLLISIONS),
+        metricTotal(METRIC_SDF_COLLISIONS),
+        metricTotal(METRIC_MESH_COLLISIONS),
+        metricTotal(METRIC_TICKS),
+        metricTotal(METRIC_COMMANDS_NS) * 1e-9,
+        metricTotal(METRIC_UPDATE_NS) * 1e-9,
+        metricTotal(METRIC_EMIT_NS) * 1e-9,
+        metricTotal(METRIC_PUBLISH_NS) * 1e-9,
+        metricTotal(METRIC_FRAMES),
+        metricTotal(METRIC_RENDER_NS) * 1e-9,
+        atomic_load(&governor.level));
+}
+
+// Answer one scrape. HTTP clients get a response with headers; a bare
+// connection that sends nothing gets the metrics text alone.
+void serveMetrics(int client) {
+    char request[1024];
+    bool http = false;
+    struct pollfd pending = { client, POLLIN, 0 };
+
+    if (poll(&pending, 1, METRICS_REQUEST_WAIT_MS) > 0) {
+        ssize_t length = recv(client, request, sizeof(request) - 1, 0);
+        http = length >= 4 && memcmp(request, "GET ", 4) == 0;
+    }
+
+    char body[4096];
+    int bodyLength = formatMetrics(body, sizeof(body));
+    if (http) {
+        char header[128];
+        int headerLength = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %d\r\n\r\n",
+            bodyLength);
+        send(client, header, headerLength, MSG_NOSIGNAL);
+    }
+    send(client, body, bodyLength, MSG_NOSIGNAL);
+}
+
+void unlinkMetricsSocket() {
+    unlink(METRICS_SOCKET_PATH);
+}
+
+// Metrics thread: serves scrapes one at a time, so it never holds up the
+// simulation or the renderer
+void* metricsThread(void* arg) {
+    int server = (int)(long)arg;
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+
+            // Out of descriptors or memory for now: wait for some to be freed
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                poll(NULL, 0, METRICS_REQUEST_WAIT_MS);
+                continue;
+            }
+            fprintf(stderr, "Error: Stopped serving metrics: %s.\n", strerror(errno));
+            close(server);
+            return NULL;
+        }
+        serveMetrics(client);
+        close(client);
+    }
+    return NULL;
+}
+
+// Bind the server to the metrics socket. A socket file left behind by an
+// instance that has gone is replaced; one that still accepts connections
+// belongs to a running instance and is left alone, failing with EADDRINUSE.
+bool bindMetricsSocket(int server, const struct sockaddr_un* address) {
+    if (bind(server, (const struct sockaddr*)address, sizeof(*address)) == 0) {
+        return true;
+    }
+    if (errno != EADDRINUSE) {
+        return false;
+    }
+
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool live = probe >= 0 && connect(probe, (const struct sockaddr*)address, sizeof(*address)) == 0;
+    if (probe >= 0) {
+        close(probe);
+    }
+    if (live) {
+        errno = EADDRINUSE;
+        return false;
+    }
+    unlinkMetricsSocket();
+    return bind(server, (const struct sockaddr*)address, sizeof(*address)) == 0;
+}
+
+// Listen on the metrics socket. Failing to is reported but not fatal.
+void startMetricsServer() {
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    strncpy(address.sun_path, METRICS_SOCKET_PATH, sizeof(address.sun_path) - 1);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || !bindMetricsSocket(server, &address) || listen(server, 4) != 0) {
+        fprintf(stderr, "Error: Could not listen on the metrics socket %s: %s.\n", METRICS_SOCKET_PATH, strerror(errno));
+        if (server >= 0) {
+            close(server);
+        }
+        return;
+    }
+    atexit(unlinkMetricsSocket);
+
+    pthread_t metrics;
+    if (pthread_create(&metrics, NULL, metricsThread, (void*)(long)server) != 0) {
+        fprintf(stderr, "Error: Could not start the metrics thread.\n");
+        close(server);
+    }
+}
+
+// Read a baked force-field grid: after any '#' comment lines, the number of
+// points along x, y and z, then a vector per point with x varying fastest,
+// all separated by white space. Returns NULL, having reported why, if the
+// file cannot be read.
+float* loadFieldGrid(const char* path, int size[3]) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open field grid %s.\n", path);
+        return NULL;
+    }
+
+    int c = fgetc(file);
+    while (c == '#') {
+        while (c != '\n' && c != EOF) {
+            c = fgetc(file);
+        }
+        c = fgetc(file);
+    }
+    ungetc(c, file);
+
+    if (fscanf(file, "%d %d %d", &size[X], &size[Y], &size[Z]) != 3 ||
+        size[X] < 2 || size[Y] < 2 || size[Z] < 2 || size[X] > 1024 || size[Y] > 1024 || size[Z] > 1024) {
+        fprintf(stderr, "Error: %s: Bad grid size, 2 to 1024 points per axis.\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    long count = (long)size[X] * size[Y] * size[Z] * 3;
+    float* grid = (float*)malloc(count * sizeof(float));
+    if (grid == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for a field grid.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        if (fscanf(file, "%f", &grid[i]) != 1) {
+            fprintf(stderr, "Error: %s: Expected %ld values after the grid size.\n", path, count);
+            fclose(file);
+            free(grid);
+            return NULL;
+        }
+    }
+
+    fclose(file);
+    return grid;
+}
+
+// Path of a file named in a scene file: relative names are taken from the
+// scene file's directory
+void resolveScenePath(const char* scenePath, const char* name, char* path, size_t size) {
+    const char* slash = strrchr(scenePath, '/');
+    if (name[0] == '/' || slash == NULL) {
+        snprintf(path, size, "%s", name);
+    }
+    else {
+        snprintf(path, size, "%.*s%s", (int)(slash - scenePath + 1), scenePath, name);
+    }
+}
+
+// Add a triangle to the mesh geometry, with its face normal at each corner.
+// Degenerate triangles are dropped.
+void addMeshTriangle(struct MeshGeometry* geometry, const float* a, const float* b, const float* c) {
+    float e1[3] = { b[X] - a[X], b[Y] - a[Y], b[Z] - a[Z] };
+    float e2[3] = { c[X] - a[X], c[Y] - a[Y], c[Z] - a[Z] };
+    float normal[3] = {
+        e1[Y] * e2[Z] - e1[Z] * e2[Y],
+        e1[Z] * e2[X] - e1[X] * e2[Z],
+        e1[X] * e2[Y] - e1[Y] * e2[X],
+    };
+    float length = sqrtf(normal[X] * normal[X] + normal[Y] * normal[Y] + normal[Z] * normal[Z]);
+    if (length == 0.0) {
+        return;
+    }
+
+    if (geometry->triangleCount == geometry->capacity) {
+        geometry->capacity = geometry->capacity > 0 ? geometry->capacity * 2 : 256;
+        geometry->vertices = (float*)realloc(geometry->vertices, geometry->capacity * 9 * sizeof(float));
+        geometry->normals = (float*)realloc(geometry->normals, geometry->capacity * 9 * sizeof(float));
+        if (geometry->vertices == NULL || geometry->normals == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed for mesh geometry.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    float* vertex = &geometry->vertices[geometry->triangleCount * 9];
+    float* vertexNormal = &geometry->normals[geometry->triangleCount * 9];
+    const float* corners[3] = { a, b, c };
+    for (int corner = 0; corner < 3; corner++) {
+        for (int axis = 0; axis < 3; axis++) {
+            vertex[corner * 3 + axis] = corners[corner][axis];
+            vertexNormal[corner * 3 + axis] = normal[axis] / length;
+        }
+    }
+    geometry->triangleCount++;
+}
+
+// Add the faces of an OBJ file, scaled and then moved to position, to the
+// mesh geometry. Only vertex and face lines are read; faces of more than
+// three corners are split into fans. Returns false, having reported why, if
+// the file cannot be read.
+bool loadObjMesh(const char* path, const float position[3], float scale, struct MeshGeometry* geometry) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open mesh %s.\n", path);
+        return false;
+    }
+
+    float* vertices = NULL;
+    int vertexCount = 0;
+    int vertexCapacity = 0;
+    bool valid = true;
+
+    char line[SCENE_LINE_LENGTH];
+    for (int lineNumber = 1; valid && fgets(line, sizeof(line), file) != NULL; lineNumber++) {
+        float v[3];
+        if (line[0] == 'v' && line[1] == ' ') {
+            valid = sscanf(line + 2, "%f %f %f", &v[X], &v[Y], &v[Z]) == 3;
+            if (!valid) {
+                fprintf(stderr, "Error: %s:%d: Bad vertex.\n", path, lineNumber);
+                break;
+            }
+            if (vertexCount == vertexCapacity) {
+                vertexCapacity = vertexCapacity > 0 ? vertexCapacity * 2 : 256;
+                vertices = (float*)realloc(vertices, vertexCapacity * 3 * sizeof(float));
+                if (vertices == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed for a mesh.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            for (int axis = 0; axis < 3; axis++) {
+                vertices[vertexCount * 3 + axis] = position[axis] + scale * v[axis];
+            }
+            vertexCount++;
+        }
+        else if (line[0] == 'f' && line[1] == ' ') {
+            // Corners are "v", "v/vt", "v//vn" or "v/vt/vn", negative
+            // indices counting back from the last vertex
+            int corners[3];
+            int cornerCount = 0;
+            char* token = strtok(line + 2, " \t\r\n");
+            for (; token != NULL; token = strtok(NULL, " \t\r\n")) {
+                int index = atoi(token);
+                index = index < 0 ? vertexCount + index : index - 1;
+                if (index < 0 || index >= vertexCount) {
+                    fprintf(stderr, "Error: %s:%d: Face refers to a missing vertex.\n", path, lineNumber);
+                    valid = false;
+                    break;
+                }
+                if (cornerCount < 2) {
+                    corners[cornerCount++] = index;
+                    continue;
+                }
+                corners[2] = index;
+                addMeshTriangle(geometry, &vertices[corners[0] * 3], &vertices[corners[1] * 3], &vertices[corners[2] * 3]);
+                corners[1] = index;
+            }
+        }
+    }
+
+    fclose(file);
+    free(vertices);
+    return valid;
+}
+
+// Triangle bounds and centroid while the BVH is built
+struct BvhItem {
+    float lo[3];
+    float hi[3];
+    float centroid[3];
+    int triangle;
+};
+
+float boxArea(const float lo[3], const float hi[3]) {
+    float d[3] = { hi[X] - lo[X], hi[Y] - lo[Y], hi[Z] - lo[Z] };
+    return 2.0 * (d[X] * d[Y] + d[Y] * d[Z] + d[Z] * d[X]);
+}
+
+void growBox(float lo[3], float hi[3], const float itemLo[3], const float itemHi[3]) {
+    for (int axis = 0; axis < 3; axis++) {
+        lo[axis] = fminf(lo[axis], itemLo[axis]);
+        hi[axis] = fmaxf(hi[axis], itemHi[axis]);
+    }
+}
+
+// Build the subtree of a node over count items from first. The items'
+// centroids are binned along each axis and the split with the lowest
+// surface area heuristic cost is taken, unless keeping the node as a leaf
+// is cheaper.
+void buildBvhNode(struct MeshGeometry* geometry, int index, struct BvhItem* items, int first, int count, int depth) {
+    struct BvhNode* node = &geometry->nodes[index];
+    float centroidLo[3] = { INFINITY, INFINITY, INFINITY };
+    float centroidHi[3] = { -INFINITY, -INFINITY, -INFINITY };
+    for (int axis = 0; axis < 3; axis++) {
+        node->lo[axis] = INFINITY;
+        node->hi[axis] = -INFINITY;
+    }
+    for (int i = first; i < first + count; i++) {
+        growBox(node->lo, node->hi, items[i].lo, items[i].hi);
+        growBox(centroidLo, centroidHi, items[i].centroid, items[i].centroid);
+    }
+    node->first = first;
+    node->count = count;
+
+    // Cost of a leaf is its triangle tests, of a split one box test plus
+    // the children's tests weighted by their chance of being visited
+    float bestCost = count;
+    int bestAxis = -1;
+    int bestSplit = 0;
+    float area = boxArea(node->lo, node->hi);
+    for (int axis = 0; axis < 3 && count > 2 && depth < BVH_MAX_DEPTH; axis++) {
+        float extent = centroidHi[axis] - centroidLo[axis];
+        if (extent <= 0.0) {
+            continue;
+        }
+
+        int binCount[BVH_BINS] = { 0 };
+        float binLo[BVH_BINS][3];
+        float binHi[BVH_BINS][3];
+        for (int b = 0; b < BVH_BINS; b++) {
+            for (int k = 0; k < 3; k++) {
+                binLo[b][k] = INFINITY;
+                binHi[b][k] = -INFINITY;
+            }
+        }
+        for (int i = first; i < first + count; i++) {
+            int b = (int)fminf((items[i].centroid[axis] - centroidLo[axis]) / extent * BVH_BINS, BVH_BINS - 1);
+            binCount[b]++;
+            growBox(binLo[b], binHi[b], items[i].lo, items[i].hi);
+        }
+
+        // Sweep from the right to get the cost of each right side, then
+        // from the left
+        float rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        float lo[3] = { INFINITY, INFINITY, INFINITY };
+        float hi[3] = { -INFINITY, -INFINITY, -INFINITY };
+        int total = 0;
+        for (int b = BVH_BINS - 1; b > 0; b--) {
+            growBox(lo, hi, binLo[b], binHi[b]);
+            total += binCount[b];
+            rightArea[b] = total > 0 ? boxArea(lo, hi) : 0.0;
+            rightCount[b] = total;
+        }
+        for (int k = 0; k < 3; k++) {
+            lo[k] = INFINITY;
+            hi[k] = -INFINITY;
+        }
+        total = 0;
+        for (int b = 0; b < BVH_BINS - 1; b++) {
+            growBox(lo, hi, binLo[b], binHi[b]);
+            total += binCount[b];
+            if (total == 0 || rightCount[b + 1] == 0) {
+                continue;
+            }
+            float cost = 1.0 + (boxArea(lo, hi) * total + rightArea[b + 1] * rightCount[b + 1]) / area;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = b + 1;
+            }
+        }
+    }
+
+    if (bestAxis < 0) {
+        return;
+    }
+
+    // Items in the bins left of the split go first
+    float extent = centroidHi[bestAxis] - centroidLo[bestAxis];
+    int middle = first;
+    for (int i = first; i < first + count; i++) {
+        int b = (int)fminf((items[i].centroid[bestAxis] - centroidLo[bestAxis]) / extent * BVH_BINS, BVH_BINS - 1);
+        if (b < bestSplit) {
+            struct BvhItem swap = items[i];
+            items[i] = items[middle];
+            items[middle++] = swap;
+        }
+    }
+
+    int left = geometry->nodeCount;
+    geometry->nodeCount += 2;
+    node->first = left;
+    node->count = 0;
+    buildBvhNode(geometry, left, items, first, middle - first, depth + 1);
+    buildBvhNode(geometry, left + 1, items, middle, first + count - middle, depth + 1);
+}
+
+// Build the BVH over all of the mesh triangles and lay the triangles out in
+// its leaf order
+void buildMeshBvh(struct MeshGeometry* geometry) {
+    int count = geometry->triangleCount;
+    struct BvhItem* items = (struct BvhItem*)malloc(count * sizeof(struct BvhItem));
+    geometry->triangles = (struct Triangle*)malloc(count * sizeof(struct Triangle));
+    geometry->nodes = (struct BvhNode*)malloc((2 * count - 1) * sizeof(struct BvhNode));
+    if (items == NULL || geometry->triangles == NULL || geometry->nodes == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for a mesh BVH.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < count; i++) {
+        const float* vertex = &geometry->vertices[i * 9];
+        for (int axis = 0; axis < 3; axis++) {
+            items[i].lo[axis] = fminf(fminf(vertex[axis], vertex[3 + axis]), vertex[6 + axis]);
+            items[i].hi[axis] = fmaxf(fmaxf(vertex[axis], vertex[3 + axis]), vertex[6 + axis]);
+            items[i].centroid[axis] = (vertex[axis] + vertex[3 + axis] + vertex[6 + axis]) / 3.0;
+        }
+        items[i].triangle = i;
+    }
+
+    geometry->nodeCount = 1;
+    buildBvhNode(geometry, 0, items, 0, count, 0);
+
+    for (int i = 0; i < count; i++) {
+        const float* vertex = &geometry->vertices[items[i].triangle * 9];
+        struct Triangle* triangle = &geometry->triangles[i];
+        for (int axis = 0; axis < 3; axis++) {
+            triangle->v0[axis] = vertex[axis];
+            triangle->e1[axis] = vertex[3 + axis] - vertex[axis];
+            triangle->e2[axis] = vertex[6 + axis] - vertex[axis];
+            triangle->normal[axis] = geometry->normals[items[i].triangle * 9 + axis];
+        }
+    }
+    free(items);
+}
+
+// Signed distance from the position to a box, negative inside
+float boxDistance(const float position[3], const float lo[3], const float hi[3]) {
+    float outside = 0.0;
+    float inside = -INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        float q = fmaxf(lo[axis] - position[axis], position[axis] - hi[axis]);
+        outside += fmaxf(q, 0.0) * fmaxf(q, 0.0);
+        inside = fmaxf(inside, q);
+    }
+    return sqrtf(outside) + fminf(inside, 0.0);
+}
+
+// Signed distance to the scene's colliders: a ground slab with the hole cut
+// through it, and the spheres
+float colliderDistance(const struct Scene* source, const float position[3]) {
+    float groundLo[3] = { -source->groundSize, -SDF_GROUND_THICKNESS, -source->groundSize };
+    float groundHi[3] = { source->groundSize, 0.0, source->groundSize };
+    float holeLo[3] = { source->hole[0], -SDF_GROUND_THICKNESS - 1.0, source->hole[1] };
+    float holeHi[3] = { source->hole[2], 1.0, source->hole[3] };
+    float distance = fmaxf(boxDistance(position, groundLo, groundHi), -boxDistance(position, holeLo, holeHi));
+
+    for (int i = 0; i < source->sphereCount; i++) {
+        const float* center = source->spheres[i].center;
+        float d = sqrtf(squaredDistance(position[X], position[Y], position[Z], center[X], center[Y], center[Z]));
+        distance = fminf(distance, d - source->sphereRadius);
+    }
+    return distance;
+}
+
+// Bake the scene's colliders into a distance grid with the given spacing,
+// covering them with SDF_MARGIN to spare. Gradients are differences of the
+// baked distances, central inside the grid and one-sided on its faces.
+// Returns NULL if the grid would be too large.
+struct DistanceGrid* bakeDistanceGrid(const struct Scene* source, float cellSize) {
+    float lo[3] = { -source->groundSize, -SDF_GROUND_THICKNESS, -source->groundSize };
+    float hi[3] = { source->groundSize, 0.0, source->groundSize };
+    for (int i = 0; i < source->sphereCount; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = fminf(lo[axis], source->spheres[i].center[axis] - source->sphereRadius);
+            hi[axis] = fmaxf(hi[axis], source->spheres[i].center[axis] + source->sphereRadius);
+        }
+    }
+
+    struct DistanceGrid* grid = (struct DistanceGrid*)malloc(sizeof(struct DistanceGrid));
+    if (grid == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for a distance grid.\n");
+        exit(EXIT_FAILURE);
+    }
+    grid->cellSize = cellSize;
+    long points = 1;
+    for (int axis = 0; axis < 3; axis++) {
+        grid->origin[axis] = lo[axis] - SDF_MARGIN;
+        grid->size[axis] = (int)ceilf((hi[axis] - lo[axis] + 2.0 * SDF_MARGIN) / cellSize) + 1;
+        points *= grid->size[axis];
+    }
+    if (points > SDF_MAX_POINTS) {
+        free(grid);
+        return NULL;
+    }
+
+    grid->samples = (float*)malloc(points * 4 * sizeof(float));
+    if (grid->samples == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for a distance grid.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    float* samples = grid->samples;
+    for (int k = 0; k < grid->size[Z]; k++) {
+        for (int j = 0; j < grid->size[Y]; j++) {
+            for (int i = 0; i < grid->size[X]; i++) {
+                float position[3] = {
+                    grid->origin[X] + i * cellSize,
+                    grid->origin[Y] + j * cellSize,
+                    grid->origin[Z] + k * cellSize,
+                };
+                samples[((k * grid->size[Y] + j) * grid->size[X] + i) * 4] = colliderDistance(source, position);
+            }
+        }
+    }
+
+    int stride[3] = { 4, grid->size[X] * 4, grid->size[X] * grid->size[Y] * 4 };
+    for (int k = 0; k < grid->size[Z]; k++) {
+        for (int j = 0; j < grid->size[Y]; j++) {
+            for (int i = 0; i < grid->size[X]; i++) {
+                int index[3] = { i, j, k };
+                float* sample = &samples[((k * grid->size[Y] + j) * grid->size[X] + i) * 4];
+                float length = 0.0;
+                for (int axis = 0; axis < 3; axis++) {
+                    const float* ahead = index[axis] < grid->size[axis] - 1 ? sample + stride[axis] : sample;
+                    const float* behind = index[axis] > 0 ? sample - stride[axis] : sample;
+                    sample[1 + axis] = ahead[0] - behind[0];
+                    length += sample[1 + axis] * sample[1 + axis];
+                }
+                length = sqrtf(length);
+                for (int axis = 0; axis < 3 && length > 0.0; axis++) {
+                    sample[1 + axis] /= length;
+                }
+            }
+        }
+    }
+    return grid;
+}
+
+// Scene files are plain text with one setting per line; '#' starts a comment.
+//   seed <n>                               ticks <n>
+//   gravity <g>                            speed_factor <k>
+//   friction <f>                           ground <half-width>
+//   hole <min x> <min z> <max x> <max z>   sphere_radius <r>
+//   hole none                              (solid ground)
+//   sphere <x> <y> <z> <r> <g> <b>         (repeatable)
+//   emitter <x> <y> <z> <spread> <rate>    (repeatable)
+//   camera <eye x> <eye y> <eye z> <target x> <target y> <target z>
+// and any number of force fields, their strengths in the units of gravity.
+// Directions are kept in steps of 1 / 4000, and each particle carries the
+// fields' change short of a whole step, in 1 / 32 of a step, to its next
+// update, so weak fields build up over time. Accelerations under about
+// 0.000004 per tick (half of 1 / 32 of a step) have no effect.
+//   wind <x> <y> <z>
+//   attractor <x> <y> <z> <strength> <radius>     (negative strength repels)
+//   vortex <x> <y> <z> <axis x> <axis y> <axis z> <strength> <radius>
+//   turbulence <strength> <wavelength> <drift>
+//   field_grid <file> <min x> <min y> <min z> <max x> <max y> <max z>
+// and, to collide against the ground and spheres baked into a distance
+// grid rather than test each of them directly,
+//   sdf <cell size>
+// OBJ files are loaded as static colliders, scaled and then moved, with
+//   mesh <file> <x> <y> <z> <scale> <r> <g> <b>   (repeatable)
+// Grid and mesh files are found relative to the scene file.
+// Settings left out keep their defaults. Listing any sphere or emitter
+// replaces the default ones. Returns NULL, having reported why, if the file
+// cannot be read or has a bad setting.
+struct Scene* loadScene(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open scene file %s.\n", path);
+        return NULL;
+    }
+
+    struct Scene* loaded = (struct Scene*)malloc(sizeof(struct Scene));
+    if (loaded == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed for the scene.\n");
+        exit(EXIT_FAILURE);
+    }
+    *loaded = defaultScene;
+    bool spheresListed = false;
+    bool emittersListed = false;
+    bool solidGround = false;
+    float sdfCellSize = 0.0;
+
+    char line[SCENE_LINE_LENGTH];
+    for (int lineNumber = 1; fgets(line, sizeof(line), file) != NULL; lineNumber++) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+
+        char key[32];
+        int offset;
+        if (sscanf(line, "%31s%n", key, &offset) != 1) {
+            continue;
+        }
+        const char* values = line + offset;
+        float v[8];
+        bool valid;
+
+        if (strcmp(key, "seed") == 0) {
+            valid = sscanf(values, "%u", &loaded->seed) == 1;
+        }
+        else if (strcmp(key, "ticks") == 0) {
+            valid = sscanf(values, "%d", &loaded->ticks) == 1 && loaded->ticks > 0;
+        }
+        else if (strcmp(key, "gravity") == 0) {
+            valid = sscanf(values, "%f", &loaded->gravity) == 1 && loaded->gravity < 0.0;
+        }
+        else if (strcmp(key, "speed_factor") == 0) {
+            valid = sscanf(values, "%f", &loaded->speedFactor) == 1 && loaded->speedFactor > 0.0;
+        }
+        else if (strcmp(key, "friction") == 0) {
+            valid = sscanf(values, "%f", &loaded->friction) == 1 &&
+                loaded->friction >= 0.0 && loaded->friction <= 1.0;
+        }
+        else if (strcmp(key, "ground") == 0) {
+            valid = sscanf(values, "%f", &loaded->groundSize) == 1 && loaded->groundSize > 0.0;
+        }
+        else if (strcmp(key, "hole") == 0) {
+            char word[8];
+            solidGround = sscanf(values, "%7s", word) == 1 && strcmp(word, "none") == 0;
+            valid = solidGround || (sscanf(values, "%f %f %f %f", &loaded->hole[0], &loaded->hole[1],
+                &loaded->hole[2], &loaded->hole[3]) == 4 &&
+                loaded->hole[0] < loaded->hole[2] && loaded->hole[1] < loaded->hole[3]);
+        }
+        else if (strcmp(key, "sphere_radius") == 0) {
+            valid = sscanf(values, "%f", &loaded->sphereRadius) == 1 && loaded->sphereRadius > 0.0;
+        }
+        else if (strcmp(key, "sphere") == 0) {
+            if (!spheresListed) {
+                loaded->sphereCount = 0;
+                spheresListed = true;
+            }
+            valid = sscanf(values, "%f %f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) == 6 &&
+                loaded->sphereCount < MAX_SPHERES;
+            if (valid) {
+                loaded->spheres[loaded->sphereCount++] = (struct Sphere){ { v[0], v[1], v[2] }, { v[3], v[4], v[5] } };
+            }
+        }
+        else if (strcmp(key, "emitter") == 0) {
+            if (!emittersListed) {
+                loaded->emitterCount = 0;
+                emittersListed = true;
+            }
+            valid = sscanf(values, "%f %f %f %f %f", &v[0], &v[1], &v[2], &v[3], &v[4]) == 5 &&
+                loaded->emitterCount < MAX_EMITTERS;
+            if (valid) {
+                loaded->emitters[loaded->emitterCount++] = (struct Emitter){ { v[0], v[1], v[2] }, v[3], v[4] };
+            }
+        }
+        else if (strcmp(key, "wind") == 0 || strcmp(key, "attractor") == 0 || strcmp(key, "vortex") == 0 ||
+            strcmp(key, "turbulence") == 0 || strcmp(key, "field_grid") == 0) {
+            struct ForceField field = { 0 };
+            if (strcmp(key, "wind") == 0) {
+                field.type = FIELD_WIND;
+                valid = sscanf(values, "%f %f %f", &field.vector[X], &field.vector[Y], &field.vector[Z]) == 3;
+            }
+            else if (strcmp(key, "attractor") == 0) {
+                field.type = FIELD_ATTRACTOR;
+                valid = sscanf(values, "%f %f %f %f %f", &field.position[X], &field.position[Y], &field.position[Z],
+                    &field.strength, &field.radius) == 5 && field.radius > 0.0;
+            }
+            else if (strcmp(key, "vortex") == 0) {
+                field.type = FIELD_VORTEX;
+                valid = sscanf(values, "%f %f %f %f %f %f %f %f", &field.position[X], &field.position[Y],
+                    &field.position[Z], &v[0], &v[1], &v[2], &field.strength, &field.radius) == 8 &&
+                    field.radius > 0.0;
+                float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+                valid = valid && length > 0.0;
+                for (int axis = 0; valid && axis < 3; axis++) {
+                    field.vector[axis] = v[axis] / length;
+                }
+            }
+            else if (strcmp(key, "turbulence") == 0) {
+                field.type = FIELD_TURBULENCE;
+                valid = sscanf(values, "%f %f %f", &field.strength, &field.radius, &field.drift) == 3 &&
+                    field.radius > 0.0;
+            }
+            else {
+                field.type = FIELD_GRID;
+                char name[SCENE_LINE_LENGTH];
+                valid = sscanf(values, "%255s %f %f %f %f %f %f", name, &field.position[X], &field.position[Y],
+                    &field.position[Z], &field.vector[X], &field.vector[Y], &field.vector[Z]) == 7 &&
+                    field.vector[X] > field.position[X] && field.vector[Y] > field.position[Y] &&
+                    field.vector[Z] > field.position[Z];
+                if (valid) {
+                    char gridPath[1024];
+                    resolveScenePath(path, name, gridPath, sizeof(gridPath));
+                    field.grid = loadFieldGrid(gridPath, field.size);
+                    valid = field.grid != NULL;
+                }
+            }
 
-void renderSphere() {
-    GLfloat mat_ambient[] = { 0.3, 0.3, 0.3, 1.0 };    
-    GLfloat mat_diffuse[] = { 0.8, 0.8, 0.8, 1.0 };   
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };  
-    GLfloat mat_shininess = 50.0;
+            valid = valid && loaded->fieldCount < MAX_FIELDS;
+            if (valid) {
+                loaded->fields[loaded->fieldCount++] = field;
+            }
+            else {
+                free(field.grid);
+            }
+        }
+        else if (strcmp(key, "sdf") == 0) {
+            valid = sscanf(values, "%f", &sdfCellSize) == 1 && sdfCellSize > 0.0;
+        }
+        else if (strcmp(key, "mesh") == 0) {
+            char name[SCENE_LINE_LENGTH];
+            struct Mesh* mesh = &loaded->meshes[loaded->meshCount];
+            valid = loaded->meshCount < MAX_MESHES &&
+                sscanf(values, "%255s %f %f %f %f %f %f %f", name, &v[0], &v[1], &v[2], &v[3],
+                    &mesh->color[0], &mesh->color[1], &mesh->color[2]) == 8 && v[3] > 0.0;
+            if (valid) {
+                if (loaded->geometry == NULL) {
+                    loaded->geometry = (struct MeshGeometry*)calloc(1, sizeof(struct MeshGeometry));
+                    if (loaded->geometry == NULL) {
+                        fprintf(stderr, "Error: Memory allocation failed for mesh geometry.\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                char meshPath[1024];
+                resolveScenePath(path, name, meshPath, sizeof(meshPath));
+                mesh->first = loaded->geometry->triangleCount;
+                valid = loadObjMesh(meshPath, v, v[3], loaded->geometry);
+                mesh->count = loaded->geometry->triangleCount - mesh->first;
+                valid = valid && mesh->count > 0;
+            }
+            if (valid) {
+                const float* vertices = &loaded->geometry->vertices[mesh->first * 9];
+                for (int axis = 0; axis < 3; axis++) {
+                    mesh->lo[axis] = INFINITY;
+                    mesh->hi[axis] = -INFINITY;
+                }
+                for (int i = 0; i < mesh->count * 3; i++) {
+                    growBox(mesh->lo, mesh->hi, &vertices[i * 3], &vertices[i * 3]);
+                }
+                loaded->meshCount++;
+            }
+        }
+        else if (strcmp(key, "camera") == 0) {
+            valid = sscanf(values, "%f %f %f %f %f %f", &loaded->eye[X], &loaded->eye[Y], &loaded->eye[Z],
+                &loaded->target[X], &loaded->target[Y], &loaded->target[Z]) == 6;
+        }
+        else {
+            fprintf(stderr, "Error: %s:%d: Unknown setting '%s'.\n", path, lineNumber, key);
+            fclose(file);
+            freeScene(loaded);
+            return NULL;
+        }
 
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialf(GL_FRONT, GL_SHININESS, mat_shininess);
+        if (!valid) {
+            fprintf(stderr, "Error: %s:%d: Bad value for '%s'.\n", path, lineNumber, key);
+            fclose(file);
+            freeScene(loaded);
+            return NULL;
+        }
+    }
 
-    glPushMatrix();
-    glColor3f(0.0, 0.8, 0.0);
-    glTranslatef(-10.0, 2.0, -10.0);
-    glutSolidSphere(SPHERE_RADIUS, 20, 20);
-    glPopMatrix();
+    fclose(file);
 
-    glPushMatrix();
-    glColor3f(0.8, 0.0, 0.0);
-    glTranslatef(5.0, 2.0, -5.0);
-    glutSolidSphere(SPHERE_RADIUS, 20, 20);
-    glPopMatrix();
-}
+    // No hole: an empty one in a far corner, so the ground strips still cover it
+    if (solidGround) {
+        for (int i = 0; i < 4; i++) {
+            loaded->hole[i] = loaded->groundSize;
+        }
+    }
 
-void renderFountain() {
-    glColor3f(0.0, 0.0, 1.0);
-    glutSolidCube(1.0);
+    if (loaded->meshCount > 0) {
+        buildMeshBvh(loaded->geometry);
+    }
+
+    // Baked once every collider is known
+    if (sdfCellSize > 0.0) {
+        loaded->sdf = bakeDistanceGrid(loaded, sdfCellSize);
+        if (loaded->sdf == NULL) {
+            fprintf(stderr, "Error: %s: The distance grid needs over %d points, use a larger cell size.\n",
+                path, SDF_MAX_POINTS);
+            freeScene(loaded);
+            return NULL;
+        }
+    }
+    return loaded;
 }
 
-// adapted code from:
-// https://stackoverflow.com/questions/20082576/how-to-overlay-text-in-opengl
-void renderCount() {
-    glMatrixMode(GL_PROJECTION);
-    glPushMatrix();
-    glLoadIdentity();
-    int w = glutGet(GLUT_WINDOW_WIDTH);
-    int h = glutGet(GLUT_WINDOW_HEIGHT);
-    glOrtho(0, w, 0, h, -1, 1);
+#ifdef __linux__
+// Scene watcher thread: reloads the scene file whenever it is written or
+// replaced, and leaves the new scene for the simulation thread to swap in
+void* sceneWatchThread(void* arg) {
+    const char* path = (const char*)arg;
+    char directory[PATH_MAX];
+    char name[NAME_MAX + 1];
+    snprintf(directory, sizeof(directory), "%s", path);
+    snprintf(name, sizeof(name), "%s", basename(directory));
+    snprintf(directory, sizeof(directory), "%s", path);
+    const char* parent = dirname(directory);
 
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glLoadIdentity();
+    // Editors often save by writing a new file and renaming it over the old
+    // one, so the directory is watched rather than the file
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, parent, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error: Could not watch scene file %s for changes.\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
 
-    glDisable(GL_DEPTH_TEST);
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t length = read(fd, events, sizeof(events));
+        if (length < 0 && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            fprintf(stderr, "Error: Stopped watching scene file %s: %s.\n", path,
+                length < 0 ? strerror(errno) : "end of events");
+            close(fd);
+            return NULL;
+        }
 
-    glDisable(GL_LIGHTING);
-    glColor3f(1, 1, 1);
+        bool changed = false;
+        for (char* p = events; p < events + length; ) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0) {
+                changed = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
 
-    glRasterPos2i(20, 20);
-    void* font = GLUT_BITMAP_TIMES_ROMAN_24; // or GLUT_BITMAP_HELVETICA_18;
-    char particleCount[50];
-    snprintf(particleCount, sizeof(particleCount), "Particle Count: %d", particleList.size);
-    for (char* c = particleCount; *c != '\0'; c++)
-    {
-        glutBitmapCharacter(font, *c);
+        struct Scene* loaded = changed ? loadScene(path) : NULL;
+        if (loaded != NULL) {
+            // A scene the simulation thread has not taken yet is superseded
+            freeScene(atomic_exchange(&pendingScene, loaded));
+            printf("Reloaded scene file %s\n", path);
+        }
     }
+    return NULL;
+}
+#endif
 
-    glEnable(GL_LIGHTING);
+// Reload the scene file on changes, where the platform can watch files
+void watchSceneFile(const char* path) {
+#ifdef __linux__
+    pthread_t watcher;
+    if (pthread_create(&watcher, NULL, sceneWatchThread, (void*)path) != 0) {
+        fprintf(stderr, "Error: Could not start the scene watcher thread.\n");
+    }
+#endif
+}
 
-    glEnable(GL_DEPTH_TEST);
+// Golden traces. A headless run is deterministic: the RNG is seeded from
+// the scene, the timestep is fixed, the one simulation thread walks the ring
+// in seq order and nothing reads the wall clock or the view. Every
+// TRACE_INTERVAL ticks a checksum of each kernel's output is taken over the
+// live particles; --record writes them out and --check reruns the scene and
+// compares against a recorded trace. Each kernel has a weighted sum, which
+// shows how far a run has drifted, and a sum of per-particle hashes of its
+// quantized output, which changes if any one particle does.
+enum TraceKernel {
+    TRACE_PARTICLES,            // Emission, expiry and compaction
+    TRACE_POSITION,             // Motion and collisions
+    TRACE_VELOCITY,
+    TRACE_SPIN,
+    TRACE_COLOR,
+    TRACE_KERNEL_COUNT,
+};
 
-    glMatrixMode(GL_MODELVIEW);
-    glPopMatrix();
-    glMatrixMode(GL_PROJECTION);
-    glPopMatrix();
+const char* traceKernelNames[TRACE_KERNEL_COUNT] = { "particles", "position", "velocity", "spin", "color" };
+
+// Relative tolerance of each kernel's sum. Runs are bit-identical, so every
+// kernel must match exactly unless a trace opts it in to slack: a kernel
+// allowed to round differently from the scalar reference (a SIMD path, a
+// reordered sum) can be given a tolerance by editing its line, which also
+// stops its hashes from being compared.
+double traceTolerance[TRACE_KERNEL_COUNT] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+
+struct TraceSample {
+    int tick;
+    double sums[TRACE_KERNEL_COUNT];
+    unsigned long long hashes[TRACE_KERNEL_COUNT];
+};
+
+struct Trace {
+    FILE* record;                   // Trace being written, or NULL
+    struct TraceSample* expected;   // Trace being checked against, or NULL
+    int expectedCount;
+    int checked;                    // Samples compared so far
+    int mismatches;
+};
+
+struct Trace trace = { NULL, NULL, 0, 0, 0 };
+
+// Mix a value into a particle's hash (the splitmix64 finalizer)
+unsigned long long traceHash(unsigned long long hash, unsigned long long value) {
+    hash = (hash ^ value) + 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ull;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBull;
+    return hash ^ (hash >> 31);
 }
 
-void renderScene() {
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    
-    // Apply rotation
-    glMatrixMode(GL_MODELVIEW);
-    glRotatef(global.angle[X], 1.0, 0.0, 0.0);
-    glRotatef(global.angle[Y], 0.0, 1.0, 0.0);
-    glRotatef(global.angle[Z], 0.0, 0.0, 1.0);
+// Mix a float's bits into a particle's hash
+unsigned long long traceHashFloat(unsigned long long hash, float value) {
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return traceHash(hash, bits);
+}
 
-    renderGround();
-    renderFountain();
-    renderSphere();
+void sampleTrace(struct TraceSample* sample) {
+    sample->tick = (int)simTime;
+    memset(sample->sums, 0, sizeof(sample->sums));
+    memset(sample->hashes, 0, sizeof(sample->hashes));
 
-    // Render particles
-    struct ParticleNode* currentNode = particleList.head;
-    while (currentNode != NULL) {
-        renderParticle(currentNode);
-        currentNode = currentNode->next;
-    }
+    bool evaluate = eventDrivenMode || lodMode;
+    for (unsigned int seq = particleList.tail; seq != particleList.head; seq++) {
+        if (isParticleRetired(seq)) {
+            continue;
+        }
 
-    // Particle view
-    if (particleView) {
-        glMatrixMode(GL_MODELVIEW);
-        glLoadIdentity();
-        gluLookAt(
-            selectedParticleNode->particle.px + 1.0,
-            selectedParticleNode->particle.py + 1.0,
-            selectedParticleNode->particle.pz + 1.0,
-            0, 0, 0, 0.0, 1.0, 0.0);
+        struct Particle particle = *particleAt(seq);
+        if (evaluate) {
+            particle = evaluateParticle(&particle, (float)(simTime - particleLaunchTime(seq)));
+        }
+        struct ParticleState state;
+        unpackParticle(&particle, &state);
+
+        // Axes are weighted so a swapped or mirrored component shows up
+        sample->sums[TRACE_PARTICLES] += 1.0;
+        sample->sums[TRACE_POSITION] += state.px + 2.0 * state.py + 3.0 * state.pz;
+        sample->sums[TRACE_VELOCITY] += (state.dx + 2.0 * state.dy + 3.0 * state.dz) * state.speed;
+        sample->sums[TRACE_SPIN] += particle.angle[X] + 2.0 * particle.angle[Y] + 3.0 * particle.angle[Z];
+        sample->sums[TRACE_COLOR] += particle.color[0] + 2.0 * particle.color[1] + 3.0 * particle.color[2];
+
+        // Hashes are summed, so they do not depend on the order particles are walked in
+        sample->hashes[TRACE_PARTICLES] += traceHash(0, seq);
+        sample->hashes[TRACE_POSITION] +=
+            traceHashFloat(traceHashFloat(traceHashFloat(0, particle.px), particle.py), particle.pz);
+        sample->hashes[TRACE_VELOCITY] += traceHash(traceHash(0, (unsigned long long)(unsigned short)particle.dx |
+            (unsigned long long)(unsigned short)particle.dy << 16 |
+            (unsigned long long)(unsigned short)particle.dz << 32 | (unsigned long long)particle.speed << 48),
+            particle.fieldRemainder);
+        sample->hashes[TRACE_SPIN] += traceHash(0, (unsigned long long)particle.angle[X] |
+            (unsigned long long)particle.angle[Y] << 16 | (unsigned long long)particle.angle[Z] << 32);
+        sample->hashes[TRACE_COLOR] += traceHash(0, particle.color[0] | particle.color[1] << 8 |
+            particle.color[2] << 16);
     }
-    renderCount();
+}
 
-    glutSwapBuffers();
+void recordTraceHeader() {
+    fprintf(trace.record, "# Golden trace: checksums of each kernel every %d ticks\n", TRACE_INTERVAL);
+    for (int kernel = 0; kernel < TRACE_KERNEL_COUNT; kernel++) {
+        fprintf(trace.record, "tolerance %s %g\n", traceKernelNames[kernel], traceTolerance[kernel]);
+    }
 }
 
-void toggleParticleView() {
-    if (!particleView) {
-        selectedParticleNode = particleList.tail;
-        particleView = true;
-        // Save current modelview matrix
-        glGetFloatv(GL_MODELVIEW_MATRIX, savedModelviewMatrix);
+void checkTraceSample(const struct TraceSample* sample) {
+    if (trace.checked >= trace.expectedCount || trace.expected[trace.checked].tick != sample->tick) {
+        fprintf(stderr, "Mismatch at tick %d: no sample in the trace.\n", sample->tick);
+        trace.mismatches++;
+        return;
     }
-    else {
-        selectedParticleNode = NULL;
-        particleView = false;
-        // Restore saved modelview matrix
-        glMatrixMode(GL_MODELVIEW);
-        glLoadMatrixf(savedModelviewMatrix);
+
+    // Only the first diverging sample is detailed, the rest follow from it
+    const struct TraceSample* expected = &trace.expected[trace.checked++];
+    bool diverged = trace.mismatches > 0;
+    for (int kernel = 0; kernel < TRACE_KERNEL_COUNT; kernel++) {
+        double error = fabs(sample->sums[kernel] - expected->sums[kernel]);
+        bool exact = traceTolerance[kernel] == 0.0;
+        if (error <= traceTolerance[kernel] * fmax(1.0, fabs(expected->sums[kernel])) &&
+            (!exact || sample->hashes[kernel] == expected->hashes[kernel])) {
+            continue;
+        }
+        if (!diverged && error > 0.0) {
+            fprintf(stderr, "Mismatch at tick %d: %s checksum is %.17g, expected %.17g (tolerance %g).\n",
+                sample->tick, traceKernelNames[kernel], sample->sums[kernel], expected->sums[kernel],
+                traceTolerance[kernel]);
+        }
+        else if (!diverged) {
+            fprintf(stderr, "Mismatch at tick %d: %s hash is %016llx, expected %016llx.\n",
+                sample->tick, traceKernelNames[kernel], sample->hashes[kernel], expected->hashes[kernel]);
+        }
+        trace.mismatches++;
     }
 }
 
-// Print keyboard commands to console for user
-void printKeyboardOptions() {
-    printf("Keyboard Options:\n\n");
-    printf("f: Fire particle(s) (hold for continuous, manual mode only)\n");
-    printf("c: Toggle constant stream mode: %s\n", constantStream ? "Enabled" : "Disabled");
-    printf("m: Toggle manual firing/single shot mode: %s\n", manualFiring ? "Enabled" : "Disabled");
-    printf("s: Toggle random speed mode: %s\n", randomSpeedMode ? "Enabled" : "Disabled");
-    printf("w: Toggle spray mode: %s\n", !sprayMode ? "Low" : "High");
-    printf("p: Toggle random particle spin mode: %s\n", randomSpinMode ? "Enabled" : "Disabled");
-    printf("b: Toggle backface culling: %s\n", backfaceCulling ? "Enabled" : "Disabled");
-    printf("g: Toggle friction mode %s\n", frictionMode ? "Enabled" : "Disabled");
-    printf("l: Toggle shading mode: %s\n", currentShadingMode == 0 ? "Flat" :"Gouraud");
-    printf("t: Reset the simulation\n\n");
-    printf("v: Toggle particle view: %s\n", particleView ? "Enabled" : "Disabled");
-    printf("x, y, z: rotate about x, y, or z axis\n");
-    printf("Left mouse: rotate clockwise faster\n");
-    printf("Right mouse: rotate counter-clockwise faster\n");
-    printf("r: reset perspective\n\n");
-    printf("1, 2, 3: Render particles as points, wireframe, or solid: %s\n\n", 
-        currentRenderMode == 1 ? "Points" : currentRenderMode == 2 ? "Wireframe" : "Solid");
-    printf("q: Exit the program\n");
-}
+// Record or check a sample when the run reaches one
+void traceTick() {
+    if ((int)simTime % TRACE_INTERVAL != 0) {
+        return;
+    }
 
-// keyboard commands
-void keyboard(unsigned char key, int x, int y) {
-    switch (key) {
-    case 'w':
-        sprayMode = !sprayMode;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'l':
-        toggleShadingMode();
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'v':       
-        toggleParticleView();
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'b':
-        toggleBackfaceCulling();
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'x':
-        global.axis = X;
-        break;
-    case 'y':
-        global.axis = Y;
-        break;
-    case 'z':
-        global.axis = Z;
-        break;
-    case 's':
-        randomSpeedMode = !randomSpeedMode;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'f':
-        if (manualFiring) {
-            createParticle();
+    struct TraceSample sample;
+    sampleTrace(&sample);
+    if (trace.record != NULL) {
+        fprintf(trace.record, "tick %d", sample.tick);
+        for (int kernel = 0; kernel < TRACE_KERNEL_COUNT; kernel++) {
+            fprintf(trace.record, " %.17g", sample.sums[kernel]);
         }
-        break;
-    case 'c':
-        constantStream = !constantStream;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'm':
-        manualFiring = !manualFiring;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'p':
-        randomSpinMode = !randomSpinMode;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 't':
-        resetSimulation();
-        break;
-    case 'g':
-        frictionMode = !frictionMode;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'r':
-        global.angle[X] = 0.0;
-        global.angle[Y] = 0.0;
-        global.angle[Z] = 0.0;
-        glPopMatrix();
-        glPushMatrix();
-        glLoadIdentity();
-        gluLookAt(0.0, 35.0, 25.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);
-        break;
-    case '1':
-        currentRenderMode = 1;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case '2':
-        currentRenderMode = 2;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case '3':
-        currentRenderMode = 3;
-        system("cls");
-        printKeyboardOptions();
-        break;
-    case 'q':
-        exit(0);
-        break;
+        for (int kernel = 0; kernel < TRACE_KERNEL_COUNT; kernel++) {
+            fprintf(trace.record, " %016llx", sample.hashes[kernel]);
+        }
+        fprintf(trace.record, "\n");
+    }
+    if (trace.expected != NULL) {
+        checkTraceSample(&sample);
     }
 }
 
-//timer function for animation
-void timerFunc(int value) {
-    if (constantStream && !manualFiring) {
-        createParticle();
+// Read a recorded trace to check the run against. Lines are
+//   tolerance <kernel> <relative tolerance>
+//   tick <tick> <particles> <position> <velocity> <spin> <color> <the five hashes, in hex>
+// with '#' starting a comment.
+bool loadTrace(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error: Could not open trace file %s.\n", path);
+        return false;
     }
 
-    updateFrame();
-    glutTimerFunc(16, timerFunc, 0);  // 60 fps
-}
+    int capacity = 0;
+    char line[TRACE_LINE_LENGTH];
+    for (int lineNumber = 1; fgets(line, sizeof(line), file) != NULL; lineNumber++) {
+        char* comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
 
-//mouse function from example code rotate2.c
-void mouse(int btn, int state, int x, int y) {
-    if (state == GLUT_DOWN) {
-        if (btn == GLUT_LEFT_BUTTON) {
-            global.angle[global.axis] = global.angle[global.axis] + 0.2;
+        char key[32];
+        int offset;
+        if (sscanf(line, "%31s%n", key, &offset) != 1) {
+            continue;
         }
-        else if (btn == GLUT_RIGHT_BUTTON) {
-            global.angle[global.axis] = global.angle[global.axis] - 0.2;
+        const char* values = line + offset;
+        bool valid = false;
+
+        if (strcmp(key, "tolerance") == 0) {
+            char name[32];
+            double tolerance;
+            if (sscanf(values, "%31s %lf", name, &tolerance) == 2 && tolerance >= 0.0) {
+                for (int kernel = 0; kernel < TRACE_KERNEL_COUNT; kernel++) {
+                    if (strcmp(name, traceKernelNames[kernel]) == 0) {
+                        traceTolerance[kernel] = tolerance;
+                        valid = true;
+                    }
+                }
+            }
+        }
+        else if (strcmp(key, "tick") == 0) {
+            if (trace.expectedCount == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                trace.expected = (struct TraceSample*)realloc(trace.expected, capacity * sizeof(struct TraceSample));
+                if (trace.expected == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed for the trace.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            struct TraceSample* sample = &trace.expected[trace.expectedCount];
+            double* sums = sample->sums;
+            unsigned long long* hashes = sample->hashes;
+            valid = sscanf(values, "%d %lf %lf %lf %lf %lf %llx %llx %llx %llx %llx", &sample->tick,
+                &sums[0], &sums[1], &sums[2], &sums[3], &sums[4],
+                &hashes[0], &hashes[1], &hashes[2], &hashes[3], &hashes[4]) == 1 + 2 * TRACE_KERNEL_COUNT;
+            trace.expectedCount += valid;
+        }
+
+        if (!valid) {
+            fprintf(stderr, "Error: %s:%d: Invalid trace line '%s'.\n", path, lineNumber, key);
+            fclose(file);
+            return false;
         }
     }
+
+    fclose(file);
+    return true;
 }
 
-// Initialise light settings
-void lightInit() {
-    GLfloat position[] = { 0.0, 1.0, 0.0, 0.0 };
-    GLfloat ambient[] = { 0.1, 0.1, 0.1, 1.0 };
-    GLfloat diffuse[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat lmodel_ambient[] = { 0.2, 0.2, 0.2, 1.0 };
+// Run the scene for its length in ticks as fast as possible, without a
+// window, and report how long it took
+void runHeadless() {
+    double start = currentTimeMs();
+    int updates = 0;
 
-    glLightfv(GL_LIGHT0, GL_POSITION, position);
-    glLightfv(GL_LIGHT0, GL_AMBIENT, ambient);
-    glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuse);
-    glLightfv(GL_LIGHT0, GL_SPECULAR, specular);
-    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, lmodel_ambient);
+    if (trace.record != NULL) {
+        recordTraceHeader();
+    }
+    while (simTime < scene->ticks) {
+        simulateTick(simStepTicks);
+        traceTick();
+        updates++;
+    }
 
-    glEnable(GL_COLOR_MATERIAL);
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0);    
+    double elapsed = currentTimeMs() - start;
+    printf("Simulated %d ticks in %.1f ms (%.3f ms per update), %d particles live\n",
+        (int)simTime, elapsed, elapsed / updates, particleList.size);
+
+    if (trace.expected != NULL) {
+        if (trace.checked < trace.expectedCount) {
+            fprintf(stderr, "Mismatch: the trace goes on to tick %d.\n", trace.expected[trace.expectedCount - 1].tick);
+            trace.mismatches++;
+        }
+        printf("Trace check %s: %d samples compared, %d mismatches\n",
+            trace.mismatches == 0 ? "passed" : "failed", trace.checked, trace.mismatches);
+    }
+}
+
+// Report a bad command line and exit
+void usageError(const char* problem, const char* argument) {
+    fprintf(stderr, "Error: %s %s.\n", problem, argument);
+    fprintf(stderr, "Usage: main [--scene <file>] [--headless] [--record <trace> | --check <trace>]\n");
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv) {
+    bool headless = false;
+    const char* scenePath = NULL;
+    const char* recordPath = NULL;
+    const char* checkPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--scene") == 0 || strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--check") == 0) {
+            if (i + 1 >= argc) {
+                usageError("Missing a file after", argv[i]);
+            }
+            if (strcmp(argv[i], "--scene") == 0) {
+                scenePath = argv[i + 1];
+            }
+            else if (strcmp(argv[i], "--record") == 0) {
+                recordPath = argv[i + 1];
+                headless = true;
+            }
+            else {
+                checkPath = argv[i + 1];
+                headless = true;
+            }
+            i++;
+        }
+        else {
+            usageError("Unknown option", argv[i]);
+        }
+    }
+
+    if (scenePath != NULL) {
+        struct Scene* loaded = loadScene(scenePath);
+        if (loaded == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        scene = loaded;
+    }
+    if (checkPath != NULL && !loadTrace(checkPath)) {
+        exit(EXIT_FAILURE);
+    }
+    if (recordPath != NULL) {
+        trace.record = fopen(recordPath, "w");
+        if (trace.record == NULL) {
+            fprintf(stderr, "Error: Could not create trace file %s.\n", recordPath);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    resizeParticleList(INITIAL_PARTICLE_CAPACITY);
+
+    // Batch runs are not scraped, and several may run at once
+    if (headless) {
+        runHeadless();
+        if (trace.record != NULL) {
+            fclose(trace.record);
+        }
+        return trace.mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    startMetricsServer();
     printKeyboardOptions();
     glutInit(&argc, argv);
     glutInitWindowSize(800, 600);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);    
     glutCreateWindow("Particle Fountain");
     glutDisplayFunc(renderScene);
+    glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
     glutMouseFunc(mouse);
-    glutTimerFunc(0, timerFunc, 0);   
+    glutIdleFunc(idleFunc);
 
     glMatrixMode(GL_PROJECTION);
     gluPerspective(45.0, 1.0, 0.1, 100.0);
     glMatrixMode(GL_MODELVIEW);
-    gluLookAt(0.0, 35.0, 25.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0);  
+    lookFromCamera(scene);
 
     glEnable(GL_DEPTH_TEST);
     lightInit();
 
-    particleList.head = particleList.tail = NULL;
-    particleList.size = 0;   
+    if (scenePath != NULL) {
+        watchSceneFile(scenePath);
+    }
+
+    pthread_t simulation;
+    if (pthread_create(&simulation, NULL, simulationThread, NULL) != 0) {
+        fprintf(stderr, "Error: Could not start the simulation thread.\n");
+        exit(EXIT_FAILURE);
+    }
 
     glutMainLoop();
 }
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Run every scene in scenes/ headless and check it against its golden trace
+# in tests/golden/. With --record, write the traces afresh instead; do that
+# only in a change meant to alter the simulation's results.
+#
+#   tests/run_golden.sh [--record] [path to the built main]
+
+cd "$(dirname "$0")/.." || exit 1
+
+mode=--check
+if [ "$1" = "--record" ]; then
+    mode=--record
+    shift
+fi
+main=${1:-./main}
+
+if [ ! -x "$main" ]; then
+    echo "Error: $main not found; build it first (see README.md)." >&2
+    exit 1
+fi
+
+failed=0
+for scene in scenes/*.scene; do
+    name=$(basename "$scene" .scene)
+    if ! "$main" --scene "$scene" "$mode" "tests/golden/$name.trace"; then
+        echo "FAILED: $name" >&2
+        failed=1
+    fi
+done
+exit $failed